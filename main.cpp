@@ -1,3 +1,4 @@
+#include <cmath>
 #include <fstream>
 #include <iomanip>
 
@@ -10,9 +11,10 @@
 
 #include <mfix.H>
 #include <mfix_F.H>
+#include <mfix_step_profiler.H>
 
 #ifdef BL_USE_CATALYST_INSITU
-#include <AMReX_ParticlesCatalystDataAdaptor.H>
+#include <mfix_insitu.H>
 #endif
 
 int   max_step    = -1;
@@ -43,10 +45,37 @@ int par_ascii_int = -1;
 int last_par_ascii  = -1;
 std::string par_ascii_file {"par"};
 
+int par_bin_int = -1;
+int last_par_bin  = -1;
+std::string par_bin_file {"par_stream"};
+bool par_bin_compress = false;
+
 int avg_int = -1;
 int last_avg  = -1;
 std::string avg_file {"avg_region"};
 
+// Monitor the averaging regions every step (incrementally, see
+// mfix::MonitorRegions) and flush the batched records every avg_int steps
+bool avg_monitor = false;
+
+// In-situ co-processing cadence: every insitu_int steps and/or every
+// insitu_per units of simulated time. Without either, every step is
+// co-processed; with only insitu_per, only the time cadence applies.
+// With insitu_staged the data is snapshotted and the pipeline overlaps with
+// the next Evolve step.
+int  insitu_int    = 1;
+Real insitu_per    = -1.0;
+bool insitu_staged = false;
+
+// Asynchronous output: the field data of checkpoint and plot files is staged
+// and written by a background writer holding at most async_io_max_mb MB of
+// staged data per rank (particle data is written synchronously).
+bool async_io = false;
+Real async_io_max_mb = 1024.0;
+
+// Benchmark and regression suite instead of the regular run (bench.suite)
+bool bench_suite = false;
+
 std::string mfix_dat {"mfix.dat"};
 
 void set_ptr_to_mfix(mfix& my_mfix);
@@ -68,10 +97,24 @@ void ReadParameters ()
 
      pp.query("avg_int", avg_int );
      pp.query("avg_file", avg_file);
+     pp.query("avg_monitor", avg_monitor);
 
      pp.query("par_ascii_file", par_ascii_file);
      pp.query("par_ascii_int", par_ascii_int);
 
+     pp.query("par_bin_file", par_bin_file);
+     pp.query("par_bin_int", par_bin_int);
+     pp.query("par_bin_compress", par_bin_compress);
+
+     pp.query("async_io", async_io);
+     pp.query("async_io_max_mb", async_io_max_mb);
+
+     pp.query("insitu_per", insitu_per);
+     if (pp.contains("insitu_per"))
+        insitu_int = -1;
+     pp.query("insitu_int", insitu_int);
+     pp.query("insitu_staged", insitu_staged);
+
      pp.query("restart", restart_file);
 
      pp.query("repl_x", repl_x);
@@ -93,6 +136,12 @@ void ReadParameters ()
      pp.query("write_eb_surface", write_eb_surface);
      pp.query("write_ls", write_ls);
   }
+
+  {
+     ParmParse pp("bench");
+
+     pp.query("suite", bench_suite);
+  }
 }
 
 int main (int argc, char* argv[])
@@ -150,6 +199,8 @@ int main (int argc, char* argv[])
 
     ReadParameters();
 
+    MFIXStepProfiler::Initialize();
+
     int solve_fluid;
     int solve_dem;
     int call_udf;
@@ -183,6 +234,8 @@ int main (int argc, char* argv[])
 
     // Initialize internals from ParamParse database
     my_mfix.InitParams(solve_fluid, solve_dem, call_udf);
+    my_mfix.InitAMRParams(regrid_int);
+    my_mfix.InitLoadBalanceParams();
 
     // Initialize memory for data-array internals
     my_mfix.ResizeArrays();
@@ -203,8 +256,18 @@ int main (int argc, char* argv[])
 
     if (solve_dem)
     {
-        // Fill level-sets on each level
-        my_mfix.fill_eb_levelsets();
+        // Fill level-sets on each level, unless a previous run with the same
+        // geometry and grids left them in the EB cache. A restart reads them
+        // from the checkpoint instead, so the cache is left alone.
+        if (!restart_file.empty())
+        {
+            my_mfix.fill_eb_levelsets();
+        }
+        else if (!my_mfix.LoadEBCache(mfix_dat))
+        {
+            my_mfix.fill_eb_levelsets();
+            my_mfix.SaveEBCache(mfix_dat);
+        }
     }
 
     // Either init from scratch or from the checkpoint file
@@ -222,18 +285,36 @@ int main (int argc, char* argv[])
         // are recomputed for the replicated system).
         my_mfix.levelset__restart = true;
 
-        // NOTE: during replication 1) this also re-builds ebfactories and
-        // level-set 2) this can change the grids
         IntVect Nrep(repl_x,repl_y,repl_z);
-        my_mfix.Restart(restart_file, &nstep, &dt, &time, Nrep);
+        if (my_mfix.CanReplicateByTiling(Nrep))
+        {
+            // Read the seed state as is and tile it across the replicated
+            // domain (grids, particles and level sets are not rebuilt)
+            IntVect Nseed(1,1,1);
+            my_mfix.Restart(restart_file, &nstep, &dt, &time, Nseed);
+            my_mfix.ReplicatedRestart(Nrep);
+        }
+        else
+        {
+            // NOTE: during replication 1) this also re-builds ebfactories and
+            // level-set 2) this can change the grids
+            my_mfix.Restart(restart_file, &nstep, &dt, &time, Nrep);
+        }
     }
 
     if (solve_fluid)
        my_mfix.mfix_setup_nodal_solver();
 
+    // Initial fluid levels (mfix.amr_max_level), tagged on the initial or
+    // restarted solution
+    if (solve_fluid)
+       my_mfix.RegridFluidLevels(time);
+
     // This checks if we want to regrid using the KDTree or KnapSack approach
     amrex::Print() << "Regridding at step " << nstep << std::endl;
+    Real strt_regrid = ParallelDescriptor::second();
     my_mfix.Regrid();
+    my_mfix.SetRebalanceCost(ParallelDescriptor::second() - strt_regrid);
 
     if (solve_dem && write_ls)
         my_mfix.WriteStaticPlotFile(static_plt_file);
@@ -252,9 +333,16 @@ int main (int argc, char* argv[])
     // only if solve_fluid = T
     Real prev_dt = dt;
 
+    if (bench_suite)
+        my_mfix.RunBenchSuite(nstep, dt, prev_dt, time, stop_time);
+
+    // The suite has advanced the solution for timing only: its output is the
+    // JSON file, no plot, checkpoint or particle files are written
+    const bool write_output = !bench_suite;
+
     // We automatically write checkpoint and plotfiles with the initial data
     //    if plot_int > 0
-    if ( (restart_file.empty() || plotfile_on_restart) && plot_int > 0 )
+    if ( write_output && (restart_file.empty() || plotfile_on_restart) && plot_int > 0 )
     {
        if (solve_fluid)
           my_mfix.mfix_compute_vort();
@@ -263,7 +351,7 @@ int main (int argc, char* argv[])
 
     // We automatically write checkpoint files with the initial data
     //    if check_int > 0
-    if ( restart_file.empty() && check_int > 0 )
+    if ( write_output && restart_file.empty() && check_int > 0 )
     {
        my_mfix.WriteCheckPointFile( check_file, nstep, dt, time );
        last_chk = nstep;
@@ -271,26 +359,53 @@ int main (int argc, char* argv[])
 
     // We automatically write ASCII files with the particle data
     //    if par_ascii_int > 0
-    if ( par_ascii_int > 0 )
+    if ( write_output && par_ascii_int > 0 )
     {
        my_mfix.WriteParticleAscii( par_ascii_file, nstep );
        last_par_ascii = nstep;
     }
 
-    if ( avg_int > 0 )
+    // We automatically append the particle data to the binary stream
+    //    if par_bin_int > 0, after dropping the records a previous run wrote
+    //    past the checkpoint we restart from
+    if ( write_output && par_bin_int > 0 )
+    {
+       if (!restart_file.empty())
+          my_mfix.RestartParticleStream( par_bin_file, nstep );
+
+       my_mfix.WriteParticleStream( par_bin_file, nstep, time, par_bin_compress );
+       last_par_bin = nstep;
+    }
+
+    // The region files of a restarted run are continued
+    if ( write_output && avg_monitor && avg_int > 0 && !restart_file.empty() )
+        my_mfix.RestartRegionMonitors( avg_file, nstep );
+
+    // So is the step profile
+    if ( write_output && !restart_file.empty() )
+        MFIXStepProfiler::Restart( nstep );
+
+    if ( write_output && avg_int > 0 )
       {
-        my_mfix.WriteAverageRegions( avg_file, nstep, time );
+        if (avg_monitor)
+           my_mfix.MonitorRegions( avg_file, nstep, time, true );
+        else
+           my_mfix.WriteAverageRegions( avg_file, nstep, time );
         last_avg = nstep;
       }
 
 #ifdef BL_USE_CATALYST_INSITU
-    amrex::ParticlesCatalystDataAdaptor *insitu_data_adaptor = new amrex::ParticlesCatalystDataAdaptor;
-    insitu_data_adaptor->Initialize();
+    MFIXInSitu insitu;
+    insitu.Initialize(insitu_staged);
+    Real last_insitu_time = time;
 #endif
 
-    bool do_not_evolve = !my_mfix.IsSteadyState() && ( (max_step == 0) ||
+    MFIXAsyncWriter writer;
+    writer.Initialize(async_io, static_cast<long>(async_io_max_mb*1024.0*1024.0));
+
+    bool do_not_evolve = bench_suite || ( !my_mfix.IsSteadyState() && ( (max_step == 0) ||
                      ( (stop_time >= 0.) && (time >  stop_time) ) ||
-                     ( (stop_time <= 0.) && (max_step <= 0) ) );
+                     ( (stop_time <= 0.) && (max_step <= 0) ) ) );
 
     { // Start profiling solve here
 
@@ -307,33 +422,58 @@ int main (int argc, char* argv[])
 
                 if (!my_mfix.IsSteadyState() && regrid_int > -1 && nstep%regrid_int == 0)
                 {
+                   MFIX_PHASE_TIMER(MFIXPhase::Regrid, -1);
                    amrex::Print() << "Regridding at step " << nstep << std::endl;
+                   my_mfix.RegridFluidLevels(time);
+
+                   Real strt_regrid = ParallelDescriptor::second();
                    my_mfix.Regrid();
+                   my_mfix.SetRebalanceCost(ParallelDescriptor::second() - strt_regrid);
                 }
 
-                my_mfix.Evolve(nstep,dt,prev_dt,time,stop_time);
+                my_mfix.StartStepWork();
+                {
+                   MFIX_PHASE_TIMER(MFIXPhase::Evolve, -1);
+                   my_mfix.Evolve(nstep,dt,prev_dt,time,stop_time);
+                }
+                my_mfix.EndStepWork();
 
                 Real end_step = ParallelDescriptor::second() - strt_step;
                 ParallelDescriptor::ReduceRealMax(end_step, ParallelDescriptor::IOProcessorNumber());
                 if (ParallelDescriptor::IOProcessor())
                     std::cout << "   Time per step        " << end_step << std::endl;
 
+                if (!my_mfix.IsSteadyState() &&
+                    my_mfix.AutoLoadBalanceCheck(nstep, ParallelDescriptor::second() - strt_step))
+                {
+                    MFIX_PHASE_TIMER(MFIXPhase::Regrid, -1);
+                    my_mfix.AutoLoadBalance();
+                }
+
                 if (!my_mfix.IsSteadyState())
                 {
                     time += prev_dt;
                     nstep++;
 
+                    Real strt_output = ParallelDescriptor::second();
+
                     if ( ( plot_int > 0) && ( nstep %  plot_int == 0 ) )
                     {
                         if (solve_fluid)
                            my_mfix.mfix_compute_vort();
-                        my_mfix.WritePlotFile( plot_file, nstep, dt, time );
+                        if (async_io)
+                           my_mfix.WritePlotFileAsync( writer, plot_file, nstep, dt, time );
+                        else
+                           my_mfix.WritePlotFile( plot_file, nstep, dt, time );
                         last_plt = nstep;
                     }
 
                     if ( ( check_int > 0) && ( nstep %  check_int == 0 ) )
                     {
-                        my_mfix.WriteCheckPointFile( check_file, nstep, dt, time );
+                        if (async_io)
+                           my_mfix.WriteCheckPointFileAsync( writer, check_file, nstep, dt, time );
+                        else
+                           my_mfix.WriteCheckPointFile( check_file, nstep, dt, time );
                         last_chk = nstep;
                     }
 
@@ -343,47 +483,45 @@ int main (int argc, char* argv[])
                         last_par_ascii = nstep;
                     }
 
+                    if ( ( par_bin_int > 0) && ( nstep %  par_bin_int == 0 ) )
+                    {
+                        my_mfix.WriteParticleStream( par_bin_file, nstep, time, par_bin_compress );
+                        last_par_bin = nstep;
+                    }
 
-                    if ( ( avg_int > 0) && ( nstep %  avg_int == 0 ) )
+
+                    if ( avg_monitor && avg_int > 0 )
+                      {
+                        my_mfix.MonitorRegions( avg_file, nstep, time, nstep % avg_int == 0 );
+                        last_avg = nstep;
+                      }
+                    else if ( ( avg_int > 0) && ( nstep %  avg_int == 0 ) )
                       {
                         my_mfix.WriteAverageRegions( avg_file, nstep, time );
                         last_avg = nstep;
                       }
 
+                    MFIXStepProfiler::Add(MFIXPhase::Output, -1,
+                                          ParallelDescriptor::second() - strt_output);
                 }
 
 #ifdef BL_USE_CATALYST_INSITU
-                /*
-                std::vector<amrex::Vector<amrex::MultiFab>*> states;
-                std::vector<std::vector<std::string>> names;
-                states.push_back(my_mfx.get_vel_g());
-                names.push_back("vel_g");
-                states.push_back(my_mfx.get_ep_g());
-                names.push_back("ep_g");
-                states.push_back(my_mfx.get_p_g());
-                names.push_back("p_g");
-                states.push_back(my_mfx.get_ro_g());
-                names.push_back("ro_g");
-                states.push_back(my_mfx.get_mu_g());
-                names.push_back("mu_g");
-                states.push_back(my_mfx.get_diveu());
-                names.push_back("diveu");
-                states.push_back(my_mfx.get_gradp_g());
-                names.push_back("gradp_g");
-                states.push_back(my_mfx.get_vort());
-                names.push_back("vort");
-                 */
-	            std::vector<std::string> real_comp_names = {"radius", "volume", "mass", "density", "oneOverI",
-                                                         "velx", "vely", "velz",
-                                                         "omegax", "omegay", "omegaz",
-                                                         "dragx", "dragy", "dragz"};
-	            std::vector<std::string> int_comp_names = {"phase", "state"};
-	            amrex::ParticleContainer<14, 2, 0, 0> * thePC = static_cast<amrex::ParticleContainer<14, 2, 0, 0> *> (my_mfix.thePC());
-                insitu_data_adaptor->CoProcess(nstep, time,
-                                               *thePC,
-                                               real_comp_names, int_comp_names
-                );
+                bool do_insitu = ( insitu_int > 0 ) && ( nstep % insitu_int == 0 );
+
+                // Time-based trigger: fire whenever we cross a multiple of insitu_per
+                if ( insitu_per > 0.0 &&
+                     std::floor(time/insitu_per) > std::floor(last_insitu_time/insitu_per) )
+                    do_insitu = true;
+
+                if ( do_insitu )
+                {
+                    MFIX_PHASE_TIMER(MFIXPhase::InSitu, -1);
+                    insitu.CoProcess(my_mfix, nstep, time, solve_fluid);
+                    last_insitu_time = time;
+                }
 #endif
+                MFIXStepProfiler::EndStep(nstep, time);
+
                 // Mechanism to terminate MFIX normally.
                 do_not_evolve =  my_mfix.IsSteadyState() || (
                      ( (stop_time >= 0.) && (time+0.1*dt >= stop_time) ) ||
@@ -394,20 +532,29 @@ int main (int argc, char* argv[])
     }
 
 #ifdef BL_USE_CATALYST_INSITU
-        insitu_data_adaptor->Finalize();
-        delete insitu_data_adaptor;
+        insitu.Finalize();
 #endif
 
+    MFIXStepProfiler::Finalize();
+
+    // Completion barrier: all staged output must be on disk before the final
+    // files are written and before anybody may restart from them
+    writer.Finalize();
+
     if (my_mfix.IsSteadyState())
         nstep = 1;
 
     // Dump plotfile at the final time
-    if ( check_int > 0 && nstep != last_chk)
+    if ( write_output && check_int > 0 && nstep != last_chk)
         my_mfix.WriteCheckPointFile( check_file    , nstep, dt, time );
-    if ( plot_int > 0  && nstep != last_plt)
+    if ( write_output && plot_int > 0  && nstep != last_plt)
         my_mfix.WritePlotFile      ( plot_file     , nstep, dt, time );
-    if ( par_ascii_int > 0  && nstep != last_par_ascii)
+    if ( write_output && par_ascii_int > 0  && nstep != last_par_ascii)
         my_mfix.WriteParticleAscii ( par_ascii_file, nstep );
+    if ( write_output && par_bin_int > 0  && nstep != last_par_bin)
+        my_mfix.WriteParticleStream( par_bin_file, nstep, time, par_bin_compress );
+    if ( write_output && avg_monitor && avg_int > 0 )
+        my_mfix.FlushRegionMonitors( avg_file );
 
     my_mfix.usr3();
 
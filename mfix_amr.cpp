@@ -0,0 +1,401 @@
+#include <algorithm>
+
+#include <AMReX_EBInterpolater.H>
+#include <AMReX_FillPatchUtil.H>
+#include <AMReX_Interpolater.H>
+#include <AMReX_ParmParse.H>
+#include <AMReX_TagBox.H>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * Dynamic fluid AMR: level construction/destruction called by AmrCore::regrid *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+// Interpolater for a field of the given index type. Cell-centered fields
+// live on EB factories: the EB-aware interpolater keeps the covered values
+// of the coarse level out of new fine cut cells.
+Interpolater* interp_for (const MultiFab& mf)
+{
+    return mf.ixType().nodeCentered() ? static_cast<Interpolater*>(&node_bilinear_interp)
+                                      : static_cast<Interpolater*>(&eb_cell_cons_interp);
+}
+
+}
+
+void
+mfix::InitAMRParams (int regrid_int)
+{
+    ParmParse pp("mfix");
+
+    pp.query("amr_max_level", amr_max_level);
+    pp.query("amr_tag_ep_g_grad", amr_tag_ep_g_grad);
+    pp.query("amr_tag_vort", amr_tag_vort);
+
+    // The fluid levels are a subset of the AmrCore levels
+    amr_max_level = std::max(0, std::min(amr_max_level, max_level));
+
+    // The fluid levels are built once during init and then only follow the
+    // solution at the regrid_int cadence
+    if (amr_max_level > 0 && regrid_int <= 0)
+        amrex::Print() << "WARNING: mfix.amr_max_level > 0 without amr.regrid_int > 0;"
+                       << " the fluid levels are built at init and never regridded"
+                       << std::endl;
+}
+
+// Fluid state fields that are carried across a regrid (as opposed to
+// temporaries, which are simply re-allocated) and the BCRecs used to
+// interpolate them
+Vector< std::pair< Vector< std::unique_ptr<MultiFab> >*, const Vector<BCRec>* > >
+mfix::FluidStateVars ()
+{
+    return {
+        {&vel_g,  &bcs_u}, {&vel_go, &bcs_u},
+        {&ep_g,   &bcs_s}, {&ep_go,  &bcs_s},
+        {&p_g,    &bcs_s}, {&p_go,   &bcs_s},
+        {&ro_g,   &bcs_s}, {&ro_go,  &bcs_s},
+        {&trac,   &bcs_s}, {&trac_o, &bcs_s},
+        {&mu_g,   &bcs_s},
+        {&p0_g,   &bcs_s},
+        {&gp,     &bcs_f}
+    };
+}
+
+void
+mfix::FillCoarsePatch (int lev, Real time, MultiFab& mf, const MultiFab& cmf,
+                       const Vector<BCRec>& bcr)
+{
+    BL_PROFILE("mfix::FillCoarsePatch()");
+
+    AMREX_ASSERT(lev > 0);
+
+    // Physical boundaries are set afterwards by mfix_set_*_bcs on all levels
+    PhysBCFunctNoOp cphysbc, fphysbc;
+
+    const int ncomp = mf.nComp();
+    Vector<BCRec> bcs(ncomp, bcr[0]);
+    for (int n = 0; n < std::min<int>(ncomp, bcr.size()); ++n)
+        bcs[n] = bcr[n];
+
+    amrex::InterpFromCoarseLevel(mf, time, cmf, 0, 0, ncomp,
+                                 geom[lev-1], geom[lev],
+                                 cphysbc, 0, fphysbc, 0,
+                                 refRatio(lev-1), interp_for(mf), bcs, 0);
+}
+
+void
+mfix::RegridParticleArrays (int lev)
+{
+    if (!solve_dem)
+        return;
+
+    // The particle grids follow the fluid grids, unless the level already
+    // has particle grids of its own (dual_grid)
+    if (!dual_grid || pc->ParticleBoxArray(lev).empty())
+    {
+        pc->SetParticleBoxArray(lev, grids[lev]);
+        pc->SetParticleDistributionMap(lev, dmap[lev]);
+    }
+
+    const BoxArray& pba = pc->ParticleBoxArray(lev);
+    const DistributionMapping& pdm = pc->ParticleDistributionMap(lev);
+
+    if (particle_ebfactory[lev] && particle_cost[lev] &&
+        particle_ebfactory[lev]->boxArray() == pba &&
+        particle_ebfactory[lev]->DistributionMap() == pdm)
+        return;
+
+    particle_ebfactory[lev].reset(
+        new EBFArrayBoxFactory(*particle_eb_levels[lev], geom[lev], pba, pdm,
+                               {m_eb_basic_grow_cells, m_eb_volume_grow_cells,
+                                m_eb_full_grow_cells}, m_eb_support_level));
+
+    particle_cost[lev].reset(new MultiFab(pba, pdm, 1, 0));
+    particle_cost[lev]->setVal(0.0);
+}
+
+void
+mfix::MakeNewLevelFromCoarse (int lev, Real time, const BoxArray& new_grids,
+                              const DistributionMapping& new_dmap)
+{
+    BL_PROFILE("mfix::MakeNewLevelFromCoarse()");
+
+    if (ooo_debug) amrex::Print() << "MakeNewLevelFromCoarse " << lev << std::endl;
+
+    SetBoxArray(lev, new_grids);
+    SetDistributionMap(lev, new_dmap);
+
+    mfix_update_ebfactory(lev);
+
+    AllocateArrays(lev);
+
+    if (solve_dem)
+    {
+        RegridParticleArrays(lev);
+        RegridLevelSetArray(lev);
+    }
+
+    for (auto& var : FluidStateVars())
+    {
+        Vector< std::unique_ptr<MultiFab> >& mf = *var.first;
+        FillCoarsePatch(lev, time, *mf[lev], *mf[lev-1], *var.second);
+    }
+
+    t_new[lev] = time;
+    t_old[lev] = time - 1.e200;
+}
+
+void
+mfix::RemakeLevel (int lev, Real time, const BoxArray& new_grids,
+                   const DistributionMapping& new_dmap)
+{
+    BL_PROFILE("mfix::RemakeLevel()");
+
+    if (ooo_debug) amrex::Print() << "RemakeLevel " << lev << std::endl;
+
+    SetBoxArray(lev, new_grids);
+    SetDistributionMap(lev, new_dmap);
+
+    mfix_update_ebfactory(lev);
+
+    // New state: interpolated from the coarse level everywhere, then
+    // overwritten with the old fine data where the old and new grids overlap
+    Vector< std::unique_ptr<MultiFab> > new_state;
+    for (auto& var : FluidStateVars())
+    {
+        Vector< std::unique_ptr<MultiFab> >& mf = *var.first;
+        const MultiFab& old_mf = *mf[lev];
+
+        const BoxArray ba = amrex::convert(new_grids, old_mf.ixType());
+
+        std::unique_ptr<MultiFab> tmp(new MultiFab(ba, new_dmap, old_mf.nComp(),
+                                                   old_mf.nGrow(), MFInfo(),
+                                                   *ebfactory[lev]));
+
+        FillCoarsePatch(lev, time, *tmp, *mf[lev-1], *var.second);
+        tmp->ParallelCopy(old_mf, 0, 0, old_mf.nComp(), 0, 0, geom[lev].periodicity());
+
+        new_state.push_back(std::move(tmp));
+    }
+
+    // Re-allocate everything else (temporaries, face and nodal arrays,
+    // costs, ...) on the new grids
+    RegridArrays(lev);
+
+    if (solve_dem)
+    {
+        RegridParticleArrays(lev);
+        RegridLevelSetArray(lev);
+    }
+
+    int i = 0;
+    for (auto& var : FluidStateVars())
+        std::swap((*var.first)[lev], new_state[i++]);
+
+    t_new[lev] = time;
+    t_old[lev] = time - 1.e200;
+}
+
+void
+mfix::ClearLevel (int lev)
+{
+    BL_PROFILE("mfix::ClearLevel()");
+
+    if (ooo_debug) amrex::Print() << "ClearLevel " << lev << std::endl;
+
+    for (auto& var : FluidStateVars())
+        (*var.first)[lev].reset();
+
+    for (auto* mf : {&vort, &drag, &diveu, &mac_rhs, &mac_phi, &diff_rhs, &diff_phi,
+                     &fp, &bcoeff_nd, &phi_nd, &particle_cost, &fluid_cost,
+                     &xslopes_u, &yslopes_u, &zslopes_u, &xslopes_s, &yslopes_s, &zslopes_s})
+        (*mf)[lev].reset();
+
+    for (int dir = 0; dir < AMREX_SPACEDIM; ++dir)
+        bcoeff_cc[lev][dir].reset();
+
+    flag[lev].reset();
+
+    ebfactory[lev].reset();
+    particle_ebfactory[lev].reset();
+}
+
+/*******************************************************************************
+ *                                                                             *
+ * Tagging                                                                     *
+ *                                                                             *
+ ******************************************************************************/
+
+void
+mfix::TagFluidCells (int lev, TagBoxArray& tags, Real time)
+{
+    BL_PROFILE("mfix::TagFluidCells()");
+
+    if (amr_tag_ep_g_grad <= 0.0 && amr_tag_vort <= 0.0)
+        return;
+
+    const MultiFab& ep  = *ep_g[lev];
+    const MultiFab& vrt = *vort[lev];
+
+    const FabArray<EBCellFlagFab>& flags = ebfactory[lev]->getMultiEBCellFlagFab();
+
+    const Real ep_thresh   = amr_tag_ep_g_grad;
+    const Real vort_thresh = amr_tag_vort;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    for (MFIter mfi(ep, true); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.tilebox();
+
+        const FabType t = flags[mfi].getType(amrex::grow(bx, 1));
+        if (t == FabType::covered)
+            continue;
+
+        Array4<Real const>      const& ep_arr   = ep.array(mfi);
+        Array4<Real const>      const& vort_arr = vrt.array(mfi);
+        Array4<EBCellFlag const> const& flag    = flags[mfi].array();
+        Array4<char>            const& tag_arr  = tags[mfi].array();
+
+        const bool regular = (t == FabType::regular);
+
+        const auto lo = amrex::lbound(bx);
+        const auto hi = amrex::ubound(bx);
+
+        for (int k = lo.z; k <= hi.z; ++k)
+        for (int j = lo.y; j <= hi.y; ++j)
+        for (int i = lo.x; i <= hi.x; ++i)
+        {
+            if (!regular && flag(i,j,k).isCovered())
+                continue;
+
+            // Covered neighbours (which hold covered_val) are replaced by
+            // the cell itself: walls are not interfaces
+            auto epn = [&] (int ii, int jj, int kk)
+            {
+                return (regular || !flag(ii,jj,kk).isCovered()) ? ep_arr(ii,jj,kk)
+                                                                 : ep_arr(i,j,k);
+            };
+
+            // Undivided gradient of the void fraction: bubble / jet interfaces
+            const Real dep = 0.5 * std::max({std::abs(epn(i+1,j,k) - epn(i-1,j,k)),
+                                             std::abs(epn(i,j+1,k) - epn(i,j-1,k)),
+                                             std::abs(epn(i,j,k+1) - epn(i,j,k-1))});
+
+            if ((ep_thresh   > 0.0 && dep > ep_thresh) ||
+                (vort_thresh > 0.0 && vort_arr(i,j,k) > vort_thresh))
+                tag_arr(i,j,k) = TagBox::SET;
+        }
+    }
+}
+
+void
+mfix::ManualTagsPlacement (int lev, TagBoxArray& tags, const Vector<IntVect>& bf_lev)
+{
+    // Only while RegridFluidLevels has the tagging fields up to date
+    if (!fluid_tagging || lev >= amr_max_level)
+        return;
+
+    // MakeNewGrids calls this after buffering the ErrorEst tags and
+    // coarsening them by bf_lev[lev]: the fluid criteria are tagged on the
+    // level's own grids, buffered and coarsened the same way, and then added
+    TagBoxArray fluid_tags(grids[lev], dmap[lev], n_error_buf[lev]);
+    fluid_tags.setVal(TagBox::CLEAR);
+
+    TagFluidCells(lev, fluid_tags, t_new[lev]);
+    fluid_tags.buffer(n_error_buf[lev]);
+    fluid_tags.coarsen(bf_lev[lev]);
+
+    AMREX_ASSERT(fluid_tags.boxArray().size() == tags.boxArray().size() &&
+                 fluid_tags.DistributionMap() == tags.DistributionMap());
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    for (MFIter mfi(tags); mfi.isValid(); ++mfi)
+    {
+        Array4<char const> const& src = fluid_tags[mfi].const_array();
+        Array4<char>       const& dst = tags[mfi].array();
+
+        // The two may have been grown by different widths before coarsening
+        const Box bx = tags[mfi].box() & fluid_tags[mfi].box();
+        const auto lo = amrex::lbound(bx);
+        const auto hi = amrex::ubound(bx);
+
+        for (int k = lo.z; k <= hi.z; ++k)
+        for (int j = lo.y; j <= hi.y; ++j)
+        for (int i = lo.x; i <= hi.x; ++i)
+            if (src(i,j,k) == TagBox::SET)
+                dst(i,j,k) = TagBox::SET;
+    }
+}
+
+void
+mfix::RegridFluidLevels (Real time)
+{
+    BL_PROFILE("mfix::RegridFluidLevels()");
+
+    if (amr_max_level == 0)
+        return;
+
+    // Tagging uses vort and the ghost cells of ep_g
+    mfix_set_scalar_bcs(time, ro_g, trac, ep_g, mu_g);
+    mfix_compute_vort();
+
+    const int old_finest = finest_level;
+
+    // AmrCore's max_level may be deeper than the fluid AMR levels
+    const int saved_max_level = max_level;
+    max_level = amr_max_level;
+
+    fluid_tagging = true;
+    regrid(0, time);
+    fluid_tagging = false;
+
+    max_level = saved_max_level;
+
+    if (m_verbose > 0)
+        amrex::Print() << "Fluid AMR: finest level " << old_finest
+                       << " -> " << finest_level << std::endl;
+
+    // Ghost cells and physical BCs of the whole carried state on the new
+    // (and remade) levels
+    mfix_set_velocity_bcs(time, vel_g,  0);
+    mfix_set_velocity_bcs(time, vel_go, 0);
+    mfix_set_scalar_bcs(time, ro_g,  trac,   ep_g,  mu_g);
+    mfix_set_scalar_bcs(time, ro_go, trac_o, ep_go, mu_g);
+
+    for (int lev = 0; lev <= finest_level; ++lev)
+    {
+        // Nodal pressures: their physical boundaries belong to the projection
+        for (auto* p : {&p_g, &p_go, &p0_g})
+            (*p)[lev]->FillBoundary(geom[lev].periodicity());
+
+        gp[lev]->FillBoundary(geom[lev].periodicity());
+
+        Box domain(geom[lev].Domain());
+        for (MFIter mfi(*gp[lev]); mfi.isValid(); ++mfi)
+            set_gradp_bcs(mfi.validbox(), lev, (*gp[lev])[mfi], domain);
+    }
+
+    // Coarse levels see the fine solution
+    for (int lev = finest_level-1; lev >= 0; --lev)
+    {
+        avgDown(lev, *vel_g[lev+1], *vel_g[lev]);
+        avgDown(lev, *ep_g[lev+1],  *ep_g[lev]);
+        avgDown(lev, *ro_g[lev+1],  *ro_g[lev]);
+        avgDown(lev, *trac[lev+1],  *trac[lev]);
+    }
+
+    // The nodal operator and the particles depend on the grid hierarchy
+    if (solve_fluid)
+        mfix_setup_nodal_solver();
+
+    if (solve_dem)
+        pc->Redistribute();
+}
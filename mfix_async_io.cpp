@@ -0,0 +1,523 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_PlotFileUtil.H>
+#include <AMReX_Utility.H>
+#include <AMReX_VisMF.H>
+
+#include <mfix.H>
+#include <mfix_async_io.H>
+
+#ifdef BL_USE_MPI
+#include <mpi.h>
+#endif
+
+namespace {
+
+const std::string level_prefix {"Level_"};
+
+// Bytes of FAB data held locally by a MultiFab (including ghost cells)
+long local_bytes (const MultiFab& mf)
+{
+    long nbytes = 0;
+    for (MFIter mfi(mf); mfi.isValid(); ++mfi)
+        nbytes += mf[mfi].nBytes();
+    return nbytes;
+}
+
+// A staged MultiFab together with its VisMF header. The header (box array,
+// min/max of every FAB) is built on the main thread, as computing it is
+// collective; only the FAB offsets are filled in by the job.
+struct StagedMF
+{
+    std::unique_ptr<MultiFab> mf;
+    VisMF::Header hdr;
+    std::string name;
+};
+
+// Deep copy of a MultiFab (valid + ghost cells) into a plain staging MultiFab
+StagedMF stage_copy (const MultiFab& src, const std::string& name)
+{
+    StagedMF s;
+    s.mf.reset(new MultiFab(src.boxArray(), src.DistributionMap(), src.nComp(), src.nGrow()));
+    MultiFab::Copy(*s.mf, src, 0, 0, src.nComp(), src.nGrow());
+    s.hdr  = VisMF::Header(*s.mf, VisMF::NFiles, VisMF::Header::Version_v1, true);
+    s.name = name;
+    return s;
+}
+
+// Writes a staged MultiFab in the VisMF (Version_v1) layout: every rank
+// writes its FABs to <name>_D_<rank> without communicating, the offsets are
+// gathered on `comm` and the IO rank writes <name>_H last.
+void write_staged (StagedMF& s, MPI_Comm comm)
+{
+    int rank = 0;
+#ifdef BL_USE_MPI
+    MPI_Comm_rank(comm, &rank);
+#endif
+
+    const std::string data_name = amrex::Concatenate(s.name + "_D_", rank, 5);
+
+    // (global FAB index, offset) of the local FABs
+    Vector<long> local;
+    if (s.mf->local_size() > 0)
+    {
+        std::ofstream os(data_name, std::ios::out | std::ios::binary);
+        for (MFIter mfi(*s.mf); mfi.isValid(); ++mfi)
+        {
+            local.push_back(mfi.index());
+            local.push_back(static_cast<long>(os.tellp()));
+            (*s.mf)[mfi].writeOn(os);
+        }
+        if (!os.good())
+            amrex::FileOpenFailed(data_name);
+    }
+
+    const int nranks = amrex::ParallelDescriptor::NProcs();
+    Vector<long> all;
+    Vector<int> counts(nranks, 0), displs(nranks, 0);
+
+#ifdef BL_USE_MPI
+    int nlocal = local.size();
+    MPI_Gather(&nlocal, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+    if (rank == 0)
+    {
+        for (int r = 1; r < nranks; ++r)
+            displs[r] = displs[r-1] + counts[r-1];
+        all.resize(displs[nranks-1] + counts[nranks-1]);
+    }
+    MPI_Gatherv(local.data(), nlocal, MPI_LONG, all.data(), counts.data(), displs.data(),
+                MPI_LONG, 0, comm);
+#else
+    all = local;
+    counts[0] = local.size();
+#endif
+
+    if (rank != 0)
+        return;
+
+    // Data files are referred to relative to the header
+    for (int r = 0; r < nranks; ++r)
+    {
+        const std::string fname = amrex::Concatenate(
+            s.name.substr(s.name.find_last_of('/') + 1) + "_D_", r, 5);
+        for (int n = displs[r]; n < displs[r] + counts[r]; n += 2)
+            s.hdr.m_fod[all[n]] = VisMF::FabOnDisk(fname, all[n+1]);
+    }
+
+    std::ofstream hdr(s.name + "_H");
+    hdr << s.hdr;
+    if (!hdr.good())
+        amrex::FileOpenFailed(s.name + "_H");
+}
+
+// Makes a finished output directory visible: all ranks are done writing
+// (barrier on `comm`), then the IO rank renames the temporary directory
+void publish (const std::string& tmp_name, const std::string& name, MPI_Comm comm)
+{
+    int rank = 0;
+#ifdef BL_USE_MPI
+    MPI_Barrier(comm);
+    MPI_Comm_rank(comm, &rank);
+#endif
+
+    if (rank != 0)
+        return;
+
+    if (amrex::FileExists(name))
+        amrex::UtilRenameDirectoryToOld(name, false);
+
+    if (std::rename(tmp_name.c_str(), name.c_str()) != 0)
+        amrex::Abort("Async output: cannot rename " + tmp_name + " to " + name);
+}
+
+}
+
+/*******************************************************************************
+ *                                                                             *
+ * MFIXAsyncWriter                                                             *
+ *                                                                             *
+ ******************************************************************************/
+
+MFIXAsyncWriter::~MFIXAsyncWriter ()
+{
+    if (!finalized)
+        Finalize();
+}
+
+void
+MFIXAsyncWriter::Initialize (bool async_in, long max_staged_bytes)
+{
+    async     = async_in;
+    max_bytes = max_staged_bytes;
+
+#ifdef BL_USE_MPI
+    if (async)
+    {
+        // Jobs issue MPI calls from the writer thread, on their own
+        // communicator
+        int provided;
+        MPI_Query_thread(&provided);
+        if (provided < MPI_THREAD_MULTIPLE)
+        {
+            amrex::Print() << "WARNING: async_io requires MPI_THREAD_MULTIPLE;"
+                           << " output will be written synchronously" << std::endl;
+            async = false;
+        }
+    }
+
+    if (async)
+        MPI_Comm_dup(amrex::ParallelDescriptor::Communicator(), &comm);
+#endif
+
+    if (async)
+        worker = std::thread(&MFIXAsyncWriter::WorkerLoop, this);
+}
+
+void
+MFIXAsyncWriter::Reserve (long nbytes)
+{
+    if (!async)
+        return;
+
+    amrex::Real strt_time = amrex::ParallelDescriptor::second();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this, nbytes] {
+        return staged_bytes == 0 || staged_bytes + nbytes <= max_bytes;
+    });
+    staged_bytes += nbytes;
+
+    t_blocked += amrex::ParallelDescriptor::second() - strt_time;
+}
+
+void
+MFIXAsyncWriter::Enqueue (long nbytes, std::function<void()> job)
+{
+    n_jobs++;
+
+    if (!async)
+    {
+        amrex::Real strt_time = amrex::ParallelDescriptor::second();
+        job();
+        amrex::Real dt = amrex::ParallelDescriptor::second() - strt_time;
+        t_write   += dt;
+        t_blocked += dt;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.emplace_back(nbytes, std::move(job));
+    }
+    cv.notify_all();
+}
+
+void
+MFIXAsyncWriter::Wait ()
+{
+    if (!async)
+        return;
+
+    BL_PROFILE("MFIXAsyncWriter::Wait()");
+
+    amrex::Real strt_time = amrex::ParallelDescriptor::second();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return queue.empty() && !busy; });
+
+    t_blocked += amrex::ParallelDescriptor::second() - strt_time;
+}
+
+void
+MFIXAsyncWriter::WorkerLoop ()
+{
+    while (true)
+    {
+        std::pair<long, std::function<void()>> item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return shutdown || !queue.empty(); });
+            if (queue.empty())
+                return;
+            item = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+        }
+
+        amrex::Real strt_time = amrex::ParallelDescriptor::second();
+
+        // Running the job releases its staged data when it goes out of scope
+        item.second();
+        item.second = nullptr;
+
+        t_write += amrex::ParallelDescriptor::second() - strt_time;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            staged_bytes -= item.first;
+            busy = false;
+        }
+        cv.notify_all();
+    }
+}
+
+void
+MFIXAsyncWriter::Finalize ()
+{
+    finalized = true;
+
+    if (worker.joinable())
+    {
+        Wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        cv.notify_all();
+        worker.join();
+
+#ifdef BL_USE_MPI
+        MPI_Comm_free(&comm);
+#endif
+        comm = amrex::ParallelDescriptor::Communicator();
+    }
+
+    if (n_jobs == 0)
+        return;
+
+    amrex::Real timers[2] = {t_blocked, t_write};
+    amrex::ParallelDescriptor::ReduceRealMax(timers, 2,
+                                             amrex::ParallelDescriptor::IOProcessorNumber());
+
+    if (amrex::ParallelDescriptor::IOProcessor())
+    {
+        std::cout << "Output jobs written         " << n_jobs
+                  << (async ? " (async)" : " (synchronous)") << std::endl;
+        std::cout << "Time blocked on output      " << timers[0] << std::endl;
+        std::cout << "Time writing output         " << timers[1] << std::endl;
+    }
+}
+
+/*******************************************************************************
+ *                                                                             *
+ * Staged output from mfix                                                     *
+ *                                                                             *
+ ******************************************************************************/
+
+void
+mfix::SnapshotParticles (std::unique_ptr<MFIXParticleContainer::ParticleContainer>& dst) const
+{
+    BL_PROFILE("mfix::SnapshotParticles()");
+
+    const MFIXParticleContainer::ParticleContainer& src = *pc;
+    const int nlevs_p = src.finestLevel() + 1;
+
+    // Re-use the snapshot container as long as the particle grids are the same
+    bool rebuild = !dst || dst->finestLevel() != src.finestLevel();
+    for (int lev = 0; !rebuild && lev < nlevs_p; ++lev)
+    {
+        rebuild = dst->ParticleBoxArray(lev) != src.ParticleBoxArray(lev) ||
+                  dst->ParticleDistributionMap(lev) != src.ParticleDistributionMap(lev);
+    }
+
+    if (rebuild)
+    {
+        Vector<Geometry> pgeom;
+        Vector<DistributionMapping> pdmap;
+        Vector<BoxArray> pba;
+        Vector<int> rr;
+        for (int lev = 0; lev < nlevs_p; ++lev)
+        {
+            pgeom.push_back(src.Geom(lev));
+            pdmap.push_back(src.ParticleDistributionMap(lev));
+            pba.push_back(src.ParticleBoxArray(lev));
+            if (lev < nlevs_p-1)
+                rr.push_back(refRatio(lev)[0]);
+        }
+        dst.reset(new MFIXParticleContainer::ParticleContainer(pgeom, pdmap, pba, rr));
+    }
+
+    for (int lev = 0; lev < nlevs_p; ++lev)
+        dst->GetParticles(lev) = src.GetParticles(lev);
+}
+
+Vector<mfix::PlotField>
+mfix::PlotFields (int lev) const
+{
+    Vector<PlotField> f;
+
+    if (!solve_fluid)
+        return f;
+
+    if( plt_vel_g   == 1) f.push_back({{"u_g", "v_g", "w_g"}, vel_g[lev].get()});
+    if( plt_gradp_g == 1) f.push_back({{"gpx", "gpy", "gpz"}, gp[lev].get()});
+    if( plt_ep_g    == 1) f.push_back({{"ep_g"},    ep_g[lev].get()});
+    if( plt_p_g     == 1) f.push_back({{"p_g"},     p_g[lev].get()});
+    if( plt_ro_g    == 1) f.push_back({{"ro_g"},    ro_g[lev].get()});
+    if( plt_mu_g    == 1) f.push_back({{"mu_g"},    mu_g[lev].get()});
+    if( plt_vort    == 1) f.push_back({{"vort"},    vort[lev].get()});
+    if( plt_diveu   == 1) f.push_back({{"diveu"},   diveu[lev].get()});
+    if( plt_volfrac == 1) f.push_back({{"volfrac"}, &(ebfactory[lev]->getVolFrac())});
+
+    return f;
+}
+
+void
+mfix::WriteCheckPointFileAsync (MFIXAsyncWriter& writer, std::string& check_file,
+                                int nstep, Real dt, Real time) const
+{
+    BL_PROFILE("mfix::WriteCheckPointFileAsync()");
+
+    const std::string& checkpointname = amrex::Concatenate( check_file, nstep );
+
+    amrex::Print() << "\n\t Writing checkpoint " << checkpointname
+                   << (writer.IsAsync() ? " (async)" : "") << std::endl;
+
+    const int nlevels = finestLevel()+1;
+
+    // Everything goes to a temporary directory that is renamed once the
+    // last byte is written, so an interrupted write never looks complete
+    const std::string tmp_name = checkpointname + ".tmp";
+
+    // Meta data describes the current grids and is cheap: write it now
+    amrex::PreBuildDirectorHierarchy(tmp_name, level_prefix, nlevels, true);
+    WriteCheckHeader(tmp_name, nstep, dt, time);
+    WriteJobInfo(tmp_name);
+
+    // The particle writers communicate on the solver's communicator, so
+    // the particles are written here rather than by the job
+    if (solve_dem)
+        pc->Checkpoint(tmp_name, "particles", true,
+                       mfix::ParticleRealCompNames(),
+                       mfix::ParticleIntCompNames());
+
+    long nbytes = 0;
+    for (int lev = 0; lev < nlevels; ++lev)
+    {
+        for (int i = 0; i < vectorVars.size(); i++ )
+            nbytes += local_bytes(*((*vectorVars[i])[lev]));
+        for (int i = 0; i < chkscalarVars.size(); i++ )
+            nbytes += local_bytes(*((*chkscalarVars[i])[lev]));
+    }
+    if (solve_dem)
+        nbytes += local_bytes(*level_sets[1]);
+
+    writer.Reserve(nbytes);
+
+    // Stage the bulk data; the job owns it until it has been written
+    std::shared_ptr< Vector<StagedMF> > staged = std::make_shared< Vector<StagedMF> >();
+
+    for (int lev = 0; lev < nlevels; ++lev)
+    {
+        for (int i = 0; i < vectorVars.size(); i++ )
+            staged->push_back(stage_copy(*((*vectorVars[i])[lev]),
+                                         amrex::MultiFabFileFullPrefix(lev, tmp_name,
+                                                                       level_prefix, vecVarsName[i])));
+        for (int i = 0; i < chkscalarVars.size(); i++ )
+            staged->push_back(stage_copy(*((*chkscalarVars[i])[lev]),
+                                         amrex::MultiFabFileFullPrefix(lev, tmp_name,
+                                                                       level_prefix, chkscaVarsName[i])));
+    }
+
+    // The level set might have a higher refinement than the mfix level
+    // => it is saved in its own (raw) file
+    if (solve_dem)
+        staged->push_back(stage_copy(*level_sets[1], tmp_name + "/ls_raw"));
+
+    const MPI_Comm comm = writer.Comm();
+
+    writer.Enqueue(nbytes, [staged, tmp_name, checkpointname, comm] ()
+    {
+        for (auto& s : *staged)
+            write_staged(s, comm);
+
+        publish(tmp_name, checkpointname, comm);
+    });
+}
+
+void
+mfix::WritePlotFileAsync (MFIXAsyncWriter& writer, std::string& plot_file,
+                          int nstep, Real dt, Real time) const
+{
+    BL_PROFILE("mfix::WritePlotFileAsync()");
+
+    const std::string& plotfilename = amrex::Concatenate( plot_file, nstep );
+
+    amrex::Print() << "  Writing plotfile " << plotfilename
+                   << (writer.IsAsync() ? " (async)" : "") << std::endl;
+
+    const int nlevels = finestLevel()+1;
+    const std::string tmp_name = plotfilename + ".tmp";
+
+    Vector<std::string> pltFldNames;
+    for (const PlotField& f : PlotFields(0))
+        pltFldNames.insert(pltFldNames.end(), f.names.begin(), f.names.end());
+
+    amrex::PreBuildDirectorHierarchy(tmp_name, level_prefix, nlevels, true);
+
+    // Particles are written here (see WriteCheckPointFileAsync)
+    if (solve_dem)
+        pc->WritePlotFile(tmp_name, "particles",
+                          write_real_comp, write_int_comp,
+                          mfix::ParticleRealCompNames(),
+                          mfix::ParticleIntCompNames());
+
+    long nbytes = 0;
+    for (int lev = 0; lev < nlevels && !pltFldNames.empty(); ++lev)
+        for (MFIter mfi(grids[lev], dmap[lev]); mfi.isValid(); ++mfi)
+            nbytes += mfi.validbox().numPts() * pltFldNames.size() * sizeof(Real);
+
+    writer.Reserve(nbytes);
+
+    // Assembling the plot MultiFab is the staging copy
+    std::shared_ptr< Vector<StagedMF> > staged = std::make_shared< Vector<StagedMF> >();
+
+    if (!pltFldNames.empty())
+    {
+        for (int lev = 0; lev < nlevels; ++lev)
+        {
+            MultiFab plt(grids[lev], dmap[lev], pltFldNames.size(), 0);
+
+            int lc = 0;
+            for (const PlotField& f : PlotFields(lev))
+            {
+                MultiFab::Copy(plt, *f.mf, 0, lc, f.names.size(), 0);
+                lc += f.names.size();
+            }
+
+            staged->push_back(stage_copy(plt, amrex::MultiFabFileFullPrefix(lev, tmp_name,
+                                                                             level_prefix, "Cell")));
+        }
+    }
+
+    Vector<BoxArray> plt_ba;
+    for (int lev = 0; lev < nlevels; ++lev)
+        plt_ba.push_back(grids[lev]);
+
+    const Vector<Geometry> plt_geom  = Geom();
+    const Vector<IntVect>  plt_ratio = refRatio();
+    const Vector<int> istep(nlevels, nstep);
+    const MPI_Comm comm = writer.Comm();
+
+    writer.Enqueue(nbytes, [staged, tmp_name, plotfilename, nlevels, pltFldNames, plt_ba,
+                            plt_geom, plt_ratio, istep, time, comm] ()
+    {
+        for (auto& s : *staged)
+            write_staged(s, comm);
+
+        // The plot file header refers to the level data: written after it
+        if (amrex::ParallelDescriptor::IOProcessor())
+        {
+            std::ofstream hdr(tmp_name + "/Header");
+            hdr.precision(17);
+            amrex::WriteGenericPlotfileHeader(hdr, nlevels, plt_ba, pltFldNames, plt_geom,
+                                              time, istep, plt_ratio);
+        }
+
+        publish(tmp_name, plotfilename, comm);
+    });
+}
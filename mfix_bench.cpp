@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <tuple>
+
+#include <AMReX_ParmParse.H>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * Benchmark and regression suite (bench.suite = 1)                            *
+ *                                                                             *
+ * Runs on whatever case the inputs set up. The canonical cases are the        *
+ * decks in benchmarks/bench_suite: a periodic box without EB, a fluidized     *
+ * bed in an EB cylinder and a discharging hopper (make_eb_cylinder and        *
+ * make_eb_hopper). Each deck sets bench.case, is sized with amr.n_cell and    *
+ * gets its particle count from the solids IC region of its mfix.dat.          *
+ *                                                                             *
+ * After bench.warmup steps the kernels are timed bench.nrep times each on a   *
+ * snapshot of the fluid and particle state, which is restored afterwards.     *
+ * The projections change their own input, so it is restored, untimed,         *
+ * before every repetition. Then bench.nsteps full steps are timed.            *
+ * Results (seconds per call, max over ranks) are written to bench.json_file.  *
+ * With bench.baseline set to an earlier JSON file of the same case and        *
+ * layout, every kernel slower than (1 + bench.threshold) times its baseline   *
+ * is reported as a regression, and with bench.fail_on_regression the run      *
+ * aborts.                                                                     *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+// Seconds per call of f, max over ranks
+template <typename F>
+Real time_kernel (int nrep, F f)
+{
+    ParallelDescriptor::Barrier();
+    const Real strt = ParallelDescriptor::second();
+    for (int r = 0; r < nrep; ++r)
+        f();
+    Real elapsed = ParallelDescriptor::second() - strt;
+    ParallelDescriptor::ReduceRealMax(elapsed);
+    return elapsed / nrep;
+}
+
+// Seconds per call of f, max over ranks, for kernels that change their own
+// input: reset() restores it, untimed, before every call
+template <typename R, typename F>
+Real time_kernel (int nrep, R reset, F f)
+{
+    Real elapsed = 0.0;
+    for (int r = 0; r < nrep; ++r)
+    {
+        reset();
+        ParallelDescriptor::Barrier();
+        const Real strt = ParallelDescriptor::second();
+        f();
+        elapsed += ParallelDescriptor::second() - strt;
+    }
+    ParallelDescriptor::ReduceRealMax(elapsed);
+    return elapsed / nrep;
+}
+
+// Copy of the valid and ghost cells of every level
+Vector< std::unique_ptr<MultiFab> > snapshot (const Vector< std::unique_ptr<MultiFab> >& src)
+{
+    Vector< std::unique_ptr<MultiFab> > dst(src.size());
+    for (int lev = 0; lev < src.size(); ++lev)
+    {
+        if (!src[lev])
+            continue;
+
+        const MultiFab& mf = *src[lev];
+        dst[lev].reset(new MultiFab(mf.boxArray(), mf.DistributionMap(), mf.nComp(), mf.nGrow()));
+        MultiFab::Copy(*dst[lev], mf, 0, 0, mf.nComp(), mf.nGrow());
+    }
+    return dst;
+}
+
+void restore (Vector< std::unique_ptr<MultiFab> >& dst,
+              const Vector< std::unique_ptr<MultiFab> >& saved)
+{
+    for (int lev = 0; lev < saved.size(); ++lev)
+        if (saved[lev])
+            MultiFab::Copy(*dst[lev], *saved[lev], 0, 0, dst[lev]->nComp(), dst[lev]->nGrow());
+}
+
+// All "key": number pairs of a JSON file written by RunBenchSuite (one per
+// line); "key": "string" pairs go to strs
+std::map<std::string, Real> read_bench_json (const std::string& file,
+                                             std::map<std::string, std::string>& strs)
+{
+    std::map<std::string, Real> vals;
+    std::ifstream is(file);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        const size_t q0 = line.find('"');
+        const size_t q1 = (q0 == std::string::npos) ? q0 : line.find('"', q0+1);
+        const size_t c  = (q1 == std::string::npos) ? q1 : line.find(':', q1);
+        if (c == std::string::npos)
+            continue;
+
+        const std::string key = line.substr(q0+1, q1-q0-1);
+
+        const size_t s0 = line.find_first_not_of(" \t", c+1);
+        if (s0 != std::string::npos && line[s0] == '"')
+        {
+            const size_t s1 = line.find('"', s0+1);
+            if (s1 != std::string::npos)
+                strs[key] = line.substr(s0+1, s1-s0-1);
+            continue;
+        }
+
+        const char* start = line.c_str() + c + 1;
+        char* end = nullptr;
+        const Real v = std::strtod(start, &end);
+        if (end != start)
+            vals[key] = v;
+    }
+    return vals;
+}
+
+}
+
+void
+mfix::RunBenchSuite (int& nstep, Real& dt, Real& prev_dt, Real& time, Real stop_time)
+{
+    BL_PROFILE("mfix::RunBenchSuite()");
+
+    ParmParse pp("bench");
+
+    int nrep = 10, nsteps = 5, warmup = 1, fail_on_regression = 0;
+    Real threshold = 0.10, min_time = 1.e-4;
+    std::string json_file = "mfix_bench.json";
+    std::string baseline;
+    std::string plot_file = "bench_plt";
+    std::string case_name = "regular";
+
+    {
+        ParmParse ppm("mfix");
+        ppm.query("geometry", case_name);
+    }
+
+    pp.query("case", case_name);
+    pp.query("nrep", nrep);
+    pp.query("nsteps", nsteps);
+    pp.query("warmup", warmup);
+    pp.query("json_file", json_file);
+    pp.query("baseline", baseline);
+    pp.query("threshold", threshold);
+    pp.query("min_time", min_time);
+    pp.query("fail_on_regression", fail_on_regression);
+    pp.query("plot_file", plot_file);
+
+    amrex::Print() << "Benchmark suite: case " << case_name << ", " << nrep
+                   << " repetitions, " << nsteps << " steps" << std::endl;
+
+    // Warm-up steps (also set dt)
+    for (int s = 0; s < warmup; ++s)
+    {
+        Evolve(nstep, dt, prev_dt, time, stop_time);
+        time += prev_dt;
+        nstep++;
+    }
+
+    // Kernels, in the order they are reported
+    Vector<std::pair<std::string, Real> > results;
+    auto record = [&results] (const std::string& name, Real t)
+    {
+        results.push_back(std::make_pair(name, t));
+        amrex::Print() << "  " << std::setw(26) << std::left << name << " " << t << " s"
+                       << std::endl;
+    };
+
+    long eb_boxes = 0, ncells = 0;
+    for (int lev = 0; lev <= finest_level; ++lev)
+    {
+        ncells += grids[lev].numPts();
+
+        const FabArray<EBCellFlagFab>& flags = ebfactory[lev]->getMultiEBCellFlagFab();
+        for (MFIter mfi(flags, false); mfi.isValid(); ++mfi)
+            if (flags[mfi].getType(mfi.validbox()) != FabType::regular)
+                ++eb_boxes;
+    }
+    ParallelDescriptor::ReduceLongSum(eb_boxes);
+
+    const long nparticles = solve_dem ? pc->TotalNumberOfParticles() : 0;
+
+    if (solve_fluid)
+    {
+        // The kernels below change the state; they run on a snapshot
+        Vector< Vector< std::unique_ptr<MultiFab> > > saved;
+        for (auto& var : FluidStateVars())
+            saved.push_back(snapshot(*var.first));
+
+        Vector< std::unique_ptr<MultiFab> > saved_phi_nd = snapshot(phi_nd);
+
+        auto restore_state = [&] ()
+        {
+            int i = 0;
+            for (auto& var : FluidStateVars())
+                restore(*var.first, saved[i++]);
+            restore(phi_nd, saved_phi_nd);
+        };
+
+        Vector< std::unique_ptr<MultiFab> > conv_u(finest_level+1), conv_s(finest_level+1);
+        Vector< std::unique_ptr<MultiFab> > u_mac(finest_level+1), v_mac(finest_level+1),
+                                            w_mac(finest_level+1);
+        for (int lev = 0; lev <= finest_level; ++lev)
+        {
+            conv_u[lev].reset(new MultiFab(grids[lev], dmap[lev], 3, 0, MFInfo(), *ebfactory[lev]));
+            conv_s[lev].reset(new MultiFab(grids[lev], dmap[lev], 2, 0, MFInfo(), *ebfactory[lev]));
+
+            const BoxArray x_ba = amrex::convert(grids[lev], IntVect::TheDimensionVector(0));
+            const BoxArray y_ba = amrex::convert(grids[lev], IntVect::TheDimensionVector(1));
+            const BoxArray z_ba = amrex::convert(grids[lev], IntVect::TheDimensionVector(2));
+            u_mac[lev].reset(new MultiFab(x_ba, dmap[lev], 1, 2, MFInfo(), *ebfactory[lev]));
+            v_mac[lev].reset(new MultiFab(y_ba, dmap[lev], 1, 2, MFInfo(), *ebfactory[lev]));
+            w_mac[lev].reset(new MultiFab(z_ba, dmap[lev], 1, 2, MFInfo(), *ebfactory[lev]));
+        }
+
+        record("ugradu_predictor", time_kernel(nrep, [&] () {
+            mfix_compute_ugradu_predictor(conv_u, conv_s, vel_g, ro_g, trac, time);
+        }));
+
+        // Convection kernels each on their own tiles: mfix_compute_ugradu on
+        // the regular ones, mfix_compute_ugradu_eb on the cut ones
+        mfix_compute_MAC_velocity_at_faces(time, vel_g, u_mac, v_mac, w_mac);
+        for (int lev = 0; lev <= finest_level; ++lev)
+            mfix_compute_slopes(lev, time, *vel_g[lev], xslopes_u, yslopes_u, zslopes_u, 0);
+
+        auto ugradu_tiles = [&] (bool cut)
+        {
+            for (int lev = 0; lev <= finest_level; ++lev)
+            {
+                Box domain(geom[lev].Domain());
+
+                const FabArray<EBCellFlagFab>& flags = ebfactory[lev]->getMultiEBCellFlagFab();
+                Array<const MultiCutFab*,AMREX_SPACEDIM> areafrac = ebfactory[lev]->getAreaFrac();
+                Array<const MultiCutFab*,AMREX_SPACEDIM> facecent = ebfactory[lev]->getFaceCent();
+
+                for (MFIter mfi(*vel_g[lev], true); mfi.isValid(); ++mfi)
+                {
+                    Box bx = mfi.tilebox();
+
+                    if (flags[mfi].getType(bx) == FabType::covered)
+                        continue;
+
+                    const bool regular =
+                        (flags[mfi].getType(amrex::grow(bx, 1)) == FabType::regular);
+
+                    if (!cut && regular)
+                        mfix_compute_ugradu(bx, conv_u, 0, vel_g, 0, 3,
+                                            xslopes_u, yslopes_u, zslopes_u, 0,
+                                            u_mac, v_mac, w_mac, &mfi, domain, lev, false);
+                    else if (cut && !regular)
+                        mfix_compute_ugradu_eb(bx, conv_u, 0, vel_g, 0, 3,
+                                               xslopes_u, yslopes_u, zslopes_u, 0,
+                                               u_mac, v_mac, w_mac, &mfi, areafrac, facecent,
+                                               &ebfactory[lev]->getVolFrac(),
+                                               &ebfactory[lev]->getBndryCent(),
+                                               domain, flags[mfi], lev, false);
+                }
+            }
+        };
+
+        record("ugradu", time_kernel(nrep, [&] () { ugradu_tiles(false); }));
+        record("ugradu_eb", time_kernel(nrep, [&] () { ugradu_tiles(true); }));
+
+        record("mac_velocity", time_kernel(nrep, [&] () {
+            mfix_compute_MAC_velocity_at_faces(time, vel_g, u_mac, v_mac, w_mac);
+        }));
+
+        // The projections overwrite their input: every repetition starts
+        // from the same face velocities / state and initial guess
+        Vector< std::unique_ptr<MultiFab> > saved_u_mac = snapshot(u_mac);
+        Vector< std::unique_ptr<MultiFab> > saved_v_mac = snapshot(v_mac);
+        Vector< std::unique_ptr<MultiFab> > saved_w_mac = snapshot(w_mac);
+        Vector< std::unique_ptr<MultiFab> > saved_mac_phi = snapshot(mac_phi);
+
+        record("mac_projection", time_kernel(nrep, [&] () {
+            restore(u_mac, saved_u_mac);
+            restore(v_mac, saved_v_mac);
+            restore(w_mac, saved_w_mac);
+            restore(mac_phi, saved_mac_phi);
+        }, [&] () {
+            apply_MAC_projection(u_mac, v_mac, w_mac, ep_g, ro_g, time, steady_state);
+        }));
+        restore(mac_phi, saved_mac_phi);
+
+        record("projection", time_kernel(nrep, restore_state, [&] () {
+            mfix_apply_projection(dt, 1.0, true);
+        }));
+
+        record("velocity_bcs", time_kernel(nrep, [&] () {
+            mfix_set_velocity_bcs(time, vel_g, 0);
+        }));
+
+        restore_state();
+    }
+
+    if (solve_dem)
+    {
+        // calc_particle_beta changes dragx, which is put back before the
+        // timed steps
+        using PIter = MFIXParticleContainer::ParticleContainer::ParIterType;
+        using AoS   = MFIXParticleContainer::ParticleContainer::AoS;
+
+        std::map<std::tuple<int,int,int>, AoS> saved_particles;
+        for (int lev = 0; lev <= finest_level; ++lev)
+            for (PIter pti(*pc, lev); pti.isValid(); ++pti)
+                saved_particles[std::make_tuple(lev, pti.index(), pti.LocalTileIndex())] =
+                    pti.GetArrayOfStructs();
+
+        record("calc_particle_beta", time_kernel(nrep, [&] () {
+            mfix_calc_particle_beta(time);
+        }));
+
+        for (int lev = 0; lev <= finest_level; ++lev)
+            for (PIter pti(*pc, lev); pti.isValid(); ++pti)
+                pti.GetArrayOfStructs() =
+                    saved_particles[std::make_tuple(lev, pti.index(), pti.LocalTileIndex())];
+    }
+
+    record("plot_file", time_kernel(1, [&] () {
+        WritePlotFile(plot_file, nstep, dt, time);
+    }));
+
+    // Full steps
+    Real step_min = 1.e200, step_max = 0.0, step_sum = 0.0;
+    for (int s = 0; s < nsteps; ++s)
+    {
+        const Real t = time_kernel(1, [&] () {
+            Evolve(nstep, dt, prev_dt, time, stop_time);
+        });
+        time += prev_dt;
+        nstep++;
+
+        step_min = std::min(step_min, t);
+        step_max = std::max(step_max, t);
+        step_sum += t;
+    }
+    if (nsteps > 0)
+    {
+        record("step_min", step_min);
+        record("step_avg", step_sum / nsteps);
+        record("step_max", step_max);
+    }
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+
+    // Comparison against the baseline (same case and layout only)
+    Vector<Real> ratio(results.size(), -1.0);
+    int nregress = 0;
+
+    if (!baseline.empty())
+    {
+        std::map<std::string, Real> base;
+        std::map<std::string, std::string> base_strs;
+        if (ParallelDescriptor::IOProcessor())
+            base = read_bench_json(baseline, base_strs);
+
+        const bool same_layout = base_strs.count("case") && base_strs["case"] == case_name &&
+                                 base.count("ncells") && base.count("nparticles") &&
+                                 base.count("nranks") && base.count("nthreads") &&
+                                 static_cast<long>(base["ncells"]) == ncells &&
+                                 static_cast<long>(base["nparticles"]) == nparticles &&
+                                 static_cast<int>(base["nranks"]) == ParallelDescriptor::NProcs() &&
+                                 static_cast<int>(base["nthreads"]) == nthreads;
+
+        if (ParallelDescriptor::IOProcessor() && !same_layout)
+        {
+            amrex::Print() << "Baseline " << baseline << " is missing or was run on a different"
+                           << " case, size or layout; not compared" << std::endl;
+        }
+        else if (ParallelDescriptor::IOProcessor())
+        {
+            amrex::Print() << "Comparison with " << baseline << " (threshold "
+                           << threshold*100 << "%)" << std::endl;
+
+            for (int n = 0; n < results.size(); ++n)
+            {
+                auto it = base.find(results[n].first);
+                if (it == base.end() || it->second < min_time)
+                    continue;
+
+                ratio[n] = results[n].second / it->second;
+                const bool slow = ratio[n] > 1.0 + threshold;
+                if (slow)
+                    ++nregress;
+
+                amrex::Print() << "  " << std::setw(26) << std::left << results[n].first
+                               << " " << std::setprecision(3) << ratio[n]
+                               << (slow ? "  REGRESSION" : "") << std::endl;
+            }
+        }
+
+        ParallelDescriptor::Bcast(&nregress, 1, ParallelDescriptor::IOProcessorNumber());
+    }
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        std::ofstream os(json_file);
+        os << std::setprecision(6) << std::scientific;
+        os << "{\n"
+           << "  \"case\": \"" << case_name << "\",\n"
+           << "  \"nranks\": " << ParallelDescriptor::NProcs() << ",\n"
+           << "  \"nthreads\": " << nthreads << ",\n"
+           << "  \"ncells\": " << ncells << ",\n"
+           << "  \"nparticles\": " << nparticles << ",\n"
+           << "  \"eb_boxes\": " << eb_boxes << ",\n"
+           << "  \"nrep\": " << nrep << ",\n"
+           << "  \"nsteps\": " << nsteps << ",\n"
+           << "  \"regressions\": " << nregress << ",\n"
+           << "  \"kernels\": {\n";
+        for (int n = 0; n < results.size(); ++n)
+            os << "    \"" << results[n].first << "\": " << results[n].second
+               << (n+1 < results.size() ? ",\n" : "\n");
+        os << "  },\n"
+           << "  \"baseline_ratio\": {\n";
+        bool first = true;
+        for (int n = 0; n < results.size(); ++n)
+        {
+            if (ratio[n] < 0.0)
+                continue;
+            os << (first ? "" : ",\n") << "    \"ratio_" << results[n].first << "\": " << ratio[n];
+            first = false;
+        }
+        os << (first ? "" : "\n") << "  }\n"
+           << "}\n";
+    }
+
+    amrex::Print() << "Benchmark results written to " << json_file << std::endl;
+
+    if (nregress > 0 && fail_on_regression)
+        amrex::Abort("Benchmark suite: performance regression against " + baseline);
+}
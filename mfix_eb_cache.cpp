@@ -0,0 +1,369 @@
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <AMReX_ParmParse.H>
+#include <AMReX_Utility.H>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * On-disk cache of the level-set data                                         *
+ *                                                                             *
+ * With mfix.eb_cache_dir set, the level sets filled by fill_eb_levelsets are  *
+ * stored in <eb_cache_dir>/<key>/, where the key is a hash of everything they *
+ * depend on: the geometry inputs, the level-set parameters, the boundary      *
+ * conditions (walls) and the particle BoxArrays. The DistributionMapping is   *
+ * not part of the key, so any rank count can use an entry.                    *
+ *                                                                             *
+ * Every level is one raw file (ls_<lev>.bin) holding the FABs (valid and      *
+ * ghost nodes) in BoxArray order. A later run maps the file into memory and   *
+ * every rank copies the FABs it owns straight out of the mapping, without     *
+ * reading the rest of the file and without communication. The header also    *
+ * records the EB volume fraction sums of every level, which are checked       *
+ * against the freshly built factories to catch geometry changes the key      *
+ * cannot see (e.g. STL files).                                                *
+ *                                                                             *
+ * Only the level sets are cached: the EB2 index space has no load path in     *
+ * AMReX, so make_eb_geometry / make_eb_factories still run on every start.    *
+ * The cache is not used on restart, where the checkpoint holds the level sets.*
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+// Input prefixes the EB geometry and the level sets depend on
+const char* geometry_prefixes[] = {
+    "mfix.geometry", "mfix.levelset__", "mfix.use_walls", "mfix.use_poly2",
+    "mfix.poly",
+    "amr.n_cell", "amr.max_level", "amr.max_grid_size", "amr.blocking_factor",
+    "amr.grid_eff", "amr.n_error_buf", "amr.ref_ratio",
+    "geometry.", "eb.", "eb2.",
+    "box.", "cylinder.", "hopper.", "cyclone.", "air_reactor.", "clr.",
+    "clr_riser.", "proto_clr.", "hourglass.", "general.",
+    "xlo.", "xhi.", "ylo.", "yhi.", "zlo.", "zhi.", "bc."
+};
+
+bool starts_with_any (const std::string& line)
+{
+    for (const char* p : geometry_prefixes)
+        if (line.compare(0, std::string(p).size(), p) == 0)
+            return true;
+    return false;
+}
+
+// 64-bit FNV-1a
+std::uint64_t fnv1a (const std::string& s)
+{
+    std::uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char c : s)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Byte offset of every FAB (grown by ngrow) in the raw file of a level, and
+// the file size as the last entry
+Vector<long> ls_offsets (const BoxArray& ba, int ngrow)
+{
+    Vector<long> offset(ba.size()+1, 0);
+    for (int i = 0; i < ba.size(); ++i)
+        offset[i+1] = offset[i] + amrex::grow(ba[i], ngrow).numPts() * sizeof(Real);
+    return offset;
+}
+
+}
+
+std::string
+mfix::EBCacheKeyText (const std::string& mfix_dat) const
+{
+    std::stringstream key;
+
+    // Geometry related inputs (dumpTable prints "prefix.name(nvals) values")
+    std::stringstream table;
+    ParmParse::dumpTable(table, true);
+    std::string line;
+    while (std::getline(table, line))
+    {
+        size_t pos = 0;
+        while (pos < line.size() && std::isspace(line[pos])) ++pos;
+        line = line.substr(pos);
+        if (starts_with_any(line))
+            key << line << "\n";
+    }
+
+    // Boundary conditions of the Fortran input deck (they can add walls)
+    std::ifstream dat(mfix_dat);
+    while (std::getline(dat, line))
+    {
+        std::string up(line);
+        for (auto& c : up) c = std::toupper(c);
+        if (up.find("BC_") != std::string::npos)
+            key << line << "\n";
+    }
+
+    key << "levelset__refinement " << levelset__refinement << "\n"
+        << "levelset__eb_refinement " << levelset__eb_refinement << "\n"
+        << "levelset__pad " << levelset__pad << "\n"
+        << "levelset__eb_pad " << levelset__eb_pad << "\n";
+
+    // Grids the level sets live on (the particle grids, refined as above),
+    // known before fill_eb_levelsets allocates them
+    for (int lev = 0; lev < level_sets.size(); ++lev)
+        key << "ls " << lev << " " << LevelSetBoxArray(lev) << "\n";
+
+    return key.str();
+}
+
+BoxArray
+mfix::LevelSetBoxArray (int lev) const
+{
+    // With a single AMR level, level_sets[1] is level 0 refined by
+    // levelset__refinement
+    BoxArray ba = amrex::convert(pc->ParticleBoxArray(nlev == 1 ? 0 : lev),
+                                 IntVect::TheNodeVector());
+    if (nlev == 1 && lev == 1)
+        ba.refine(levelset__refinement);
+    return ba;
+}
+
+const DistributionMapping&
+mfix::LevelSetDistributionMap (int lev) const
+{
+    return pc->ParticleDistributionMap(nlev == 1 ? 0 : lev);
+}
+
+std::string
+mfix::EBCacheEntry (const std::string& key_text) const
+{
+    std::string dir;
+    ParmParse pp("mfix");
+    pp.query("eb_cache_dir", dir);
+
+    if (dir.empty())
+        return dir;
+
+    std::stringstream ss;
+    ss << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << fnv1a(key_text);
+    return ss.str();
+}
+
+Vector<Real>
+mfix::EBVolFracSums () const
+{
+    Vector<Real> sums;
+    for (int lev = 0; lev <= finest_level; ++lev)
+        sums.push_back(ebfactory[lev]->getVolFrac().sum(0));
+    return sums;
+}
+
+bool
+mfix::LoadEBCache (const std::string& mfix_dat)
+{
+    BL_PROFILE("mfix::LoadEBCache()");
+
+    const std::string key_text = EBCacheKeyText(mfix_dat);
+    const std::string entry    = EBCacheEntry(key_text);
+
+    if (entry.empty())
+        return false;
+
+    const Vector<Real> vf = EBVolFracSums();
+
+    // The IO processor checks the entry, so that all ranks take the same decision
+    int valid = 0, found = 0;
+    if (ParallelDescriptor::IOProcessor() && amrex::FileExists(entry + "/Header"))
+    {
+        found = 1;
+
+        std::ifstream hdr(entry + "/Header");
+        std::string version;
+        int nls = 0, nvf = 0, real_bytes = 0, ngrow = -1;
+        hdr >> version >> real_bytes >> ngrow >> nls >> nvf;
+
+        Vector<Real> vf_cached(nvf);
+        for (auto& v : vf_cached)
+            hdr >> v;
+
+        valid = (version == "MFIX-EBCache-V2") && (real_bytes == sizeof(Real)) &&
+                (ngrow == levelset__pad) && (nls == level_sets.size()) && (nvf == vf.size());
+        for (int lev = 0; valid && lev < nvf; ++lev)
+            valid = std::abs(vf[lev] - vf_cached[lev]) <= 1.e-10 * std::max(1.0, std::abs(vf[lev]));
+        for (int lev = 0; valid && lev < nls; ++lev)
+            valid = amrex::FileExists(entry + "/ls_" + std::to_string(lev) + ".bin");
+    }
+    ParallelDescriptor::Bcast(&found, 1, ParallelDescriptor::IOProcessorNumber());
+    ParallelDescriptor::Bcast(&valid, 1, ParallelDescriptor::IOProcessorNumber());
+
+    if (!valid)
+    {
+        if (found)
+            amrex::Print() << "EB cache " << entry << " does not match the geometry; rebuilding"
+                           << std::endl;
+        return false;
+    }
+
+    // Allocate the level sets the way fill_eb_levelsets does and copy the
+    // local FABs of every level out of the mapped file
+    int ok = 1;
+    for (int lev = 0; ok && lev < level_sets.size(); ++lev)
+    {
+        level_sets[lev].reset(new MultiFab(LevelSetBoxArray(lev), LevelSetDistributionMap(lev),
+                                           1, levelset__pad));
+
+        MultiFab& dst = *level_sets[lev];
+        const Vector<long> offset = ls_offsets(dst.boxArray(), dst.nGrow());
+        const std::string file = entry + "/ls_" + std::to_string(lev) + ".bin";
+
+        if (dst.local_size() == 0)
+            continue;
+
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 || st.st_size != offset.back())
+        {
+            if (fd >= 0)
+                ::close(fd);
+            ok = 0;
+            break;
+        }
+
+        void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+        {
+            ok = 0;
+            break;
+        }
+
+        const char* bytes = static_cast<const char*>(map);
+        for (MFIter mfi(dst); mfi.isValid(); ++mfi)
+        {
+            FArrayBox& fab = dst[mfi];
+            std::memcpy(fab.dataPtr(), bytes + offset[mfi.index()], fab.nBytes());
+        }
+
+        ::munmap(map, st.st_size);
+    }
+
+    ParallelDescriptor::ReduceIntMin(ok);
+    if (!ok)
+    {
+        amrex::Print() << "EB cache " << entry << " has different level-set grids; rebuilding"
+                       << std::endl;
+        return false;
+    }
+
+    amrex::Print() << "Level sets read from EB cache " << entry << std::endl;
+
+    return true;
+}
+
+void
+mfix::SaveEBCache (const std::string& mfix_dat) const
+{
+    BL_PROFILE("mfix::SaveEBCache()");
+
+    const std::string key_text = EBCacheKeyText(mfix_dat);
+    const std::string entry    = EBCacheEntry(key_text);
+
+    if (entry.empty())
+        return;
+
+    // An entry is only usable with every level present
+    for (int lev = 0; lev < level_sets.size(); ++lev)
+        AMREX_ALWAYS_ASSERT(level_sets[lev] && level_sets[lev]->nGrow() == levelset__pad);
+
+    // Written to a temporary directory and renamed, so that concurrent runs
+    // never see a partial entry. mkdtemp makes the name unique, also across
+    // jobs of a parameter sweep that start together.
+    std::vector<char> tmp_buf(entry.begin(), entry.end());
+    const std::string suffix = ".tmpXXXXXX";
+    tmp_buf.insert(tmp_buf.end(), suffix.begin(), suffix.end());
+    tmp_buf.push_back('\0');
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        const std::string cache_dir = entry.substr(0, entry.rfind('/'));
+        if (!amrex::UtilCreateDirectory(cache_dir, 0755))
+            amrex::CreateDirectoryFailed(cache_dir);
+
+        if (::mkdtemp(tmp_buf.data()) == nullptr)
+            amrex::CreateDirectoryFailed(tmp_buf.data());
+        ::chmod(tmp_buf.data(), 0755);
+    }
+    ParallelDescriptor::Bcast(tmp_buf.data(), tmp_buf.size(), ParallelDescriptor::IOProcessorNumber());
+    const std::string tmp_name(tmp_buf.data());
+
+    for (int lev = 0; lev < level_sets.size(); ++lev)
+    {
+        const MultiFab& ls = *level_sets[lev];
+        const Vector<long> offset = ls_offsets(ls.boxArray(), ls.nGrow());
+        const std::string file = tmp_name + "/ls_" + std::to_string(lev) + ".bin";
+
+        // The IO processor sizes the file, then every rank writes its FABs
+        // at their offsets
+        if (ParallelDescriptor::IOProcessor())
+        {
+            std::ofstream os(file, std::ios::binary | std::ios::trunc);
+            if (offset.back() > 0)
+            {
+                os.seekp(offset.back()-1);
+                os.put(0);
+            }
+            if (!os.good())
+                amrex::FileOpenFailed(file);
+        }
+        ParallelDescriptor::Barrier();
+
+        if (ls.local_size() > 0)
+        {
+            std::fstream os(file, std::ios::binary | std::ios::in | std::ios::out);
+            for (MFIter mfi(ls); mfi.isValid(); ++mfi)
+            {
+                const FArrayBox& fab = ls[mfi];
+                os.seekp(offset[mfi.index()]);
+                os.write(reinterpret_cast<const char*>(fab.dataPtr()), fab.nBytes());
+            }
+            if (!os.good())
+                amrex::FileOpenFailed(file);
+        }
+        ParallelDescriptor::Barrier();
+    }
+
+    const Vector<Real> vf = EBVolFracSums();
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        std::ofstream hdr(tmp_name + "/Header");
+        hdr << std::setprecision(17);
+        hdr << "MFIX-EBCache-V2\n" << sizeof(Real) << "\n" << levelset__pad << "\n"
+            << level_sets.size() << "\n" << vf.size() << "\n";
+        for (const Real v : vf)
+            hdr << v << "\n";
+        hdr << "# key\n" << key_text;
+        hdr.close();
+
+        if (amrex::FileExists(entry) || std::rename(tmp_name.c_str(), entry.c_str()) != 0)
+            amrex::Print() << "EB cache entry " << entry << " already present; "
+                           << tmp_name << " can be removed" << std::endl;
+        else
+            amrex::Print() << "Level sets stored in EB cache " << entry << std::endl;
+    }
+    ParallelDescriptor::Barrier();
+}
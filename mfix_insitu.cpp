@@ -0,0 +1,287 @@
+#ifdef BL_USE_CATALYST_INSITU
+
+#include <algorithm>
+#include <iostream>
+
+#include <mfix.H>
+#include <mfix_insitu.H>
+
+#ifdef BL_USE_MPI
+#include <mpi.h>
+#endif
+
+namespace {
+
+// Component names of a fluid field as seen by the in-situ pipeline: scalars
+// keep their name, vectors get an _x/_y/_z suffix.
+std::vector<std::string> insitu_comp_names (const std::string& name, int ncomp)
+{
+    if (ncomp == 1)
+        return {name};
+
+    const char* suffix[] = {"_x", "_y", "_z"};
+    std::vector<std::string> r;
+    for (int n = 0; n < ncomp; ++n)
+        r.push_back(name + suffix[n]);
+    return r;
+}
+
+// Collect zero-copy views of the fluid fields handed to Catalyst, together
+// with their component names. EB volfrac is passed along for masking.
+void fluid_views (const mfix& my_mfix,
+                  std::vector<amrex::Vector<amrex::MultiFab>>& fields,
+                  std::vector<std::vector<std::string>>& names)
+{
+    fields.clear();
+    names.clear();
+
+    fields.push_back(my_mfix.get_vel_g());
+    names.push_back(insitu_comp_names("vel_g", AMREX_SPACEDIM));
+    fields.push_back(my_mfix.get_ep_g());
+    names.push_back(insitu_comp_names("ep_g", 1));
+    fields.push_back(my_mfix.get_p_g());
+    names.push_back(insitu_comp_names("p_g", 1));
+    fields.push_back(my_mfix.get_ro_g());
+    names.push_back(insitu_comp_names("ro_g", 1));
+    fields.push_back(my_mfix.get_mu_g());
+    names.push_back(insitu_comp_names("mu_g", 1));
+    fields.push_back(my_mfix.get_diveu());
+    names.push_back(insitu_comp_names("diveu", 1));
+    fields.push_back(my_mfix.get_gradp_g());
+    names.push_back(insitu_comp_names("gradp_g", AMREX_SPACEDIM));
+    fields.push_back(my_mfix.get_vort());
+    names.push_back(insitu_comp_names("vort", 1));
+    fields.push_back(my_mfix.get_volfrac());
+    names.push_back(insitu_comp_names("volfrac", 1));
+}
+
+// Deep copy (valid cells only) of a per-level field into a staging buffer.
+// The buffer's allocation is reused as long as the grids do not change.
+void stage_copy (const amrex::Vector<amrex::MultiFab>& src,
+                 amrex::Vector<amrex::MultiFab>& dst)
+{
+    dst.resize(src.size());
+    for (int lev = 0; lev < src.size(); ++lev)
+    {
+        const amrex::MultiFab& s = src[lev];
+        amrex::MultiFab& d = dst[lev];
+
+        if (!d.ok() || d.boxArray() != s.boxArray() ||
+            d.DistributionMap() != s.DistributionMap() || d.nComp() != s.nComp())
+        {
+            d.clear();
+            d.define(s.boxArray(), s.DistributionMap(), s.nComp(), 0);
+        }
+
+        amrex::MultiFab::Copy(d, s, 0, 0, s.nComp(), 0);
+    }
+}
+
+}
+
+MFIXInSitu::~MFIXInSitu ()
+{
+    if (adaptor != nullptr)
+        Finalize();
+}
+
+void
+MFIXInSitu::Initialize (bool staged_in)
+{
+    staged = staged_in;
+
+#ifdef BL_USE_MPI
+    if (staged)
+    {
+        // The pipeline runs collectives (on its own communicator) on the
+        // worker thread while the main thread keeps communicating in Evolve.
+        int provided;
+        MPI_Query_thread(&provided);
+        if (provided < MPI_THREAD_MULTIPLE)
+        {
+            amrex::Print() << "WARNING: insitu staging requires MPI_THREAD_MULTIPLE;"
+                           << " falling back to synchronous co-processing" << std::endl;
+            staged = false;
+        }
+    }
+#endif
+
+    // Collectives of the pipeline (staged: on the worker thread) must not
+    // interleave with those of Evolve on the same communicator
+#ifdef BL_USE_MPI
+    MPI_Comm_dup(amrex::ParallelDescriptor::Communicator(), &insitu_comm);
+#else
+    insitu_comm = amrex::ParallelDescriptor::Communicator();
+#endif
+
+    adaptor = new amrex::ParticlesCatalystDataAdaptor;
+    adaptor->Initialize(insitu_comm);
+
+    if (staged)
+        worker = std::thread(&MFIXInSitu::WorkerLoop, this);
+}
+
+void
+MFIXInSitu::CoProcess (mfix& my_mfix, int nstep, amrex::Real time, int solve_fluid)
+{
+    BL_PROFILE("MFIXInSitu::CoProcess()");
+
+    amrex::Real strt_time = amrex::ParallelDescriptor::second();
+
+    if (solve_fluid)
+        my_mfix.mfix_compute_vort();
+
+    if (!staged)
+    {
+        // Synchronous: hand over the live data, no copies
+        Stage stage;
+        stage.nstep = nstep;
+        stage.time  = time;
+        stage.geom      = my_mfix.Geom();
+        stage.ref_ratio = my_mfix.refRatio();
+        if (solve_fluid)
+            fluid_views(my_mfix, stage.fields, stage.names);
+
+        InSituPC* pc = my_mfix.thePC();
+        RunPipeline(stage, *pc);
+    }
+    else
+    {
+        Stage& stage = stages[next_stage];
+
+        // Only blocks if the pipeline is still busy with this buffer, i.e.
+        // it has fallen more than one co-processing interval behind
+        {
+            amrex::Real strt_wait = amrex::ParallelDescriptor::second();
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&stage] { return !stage.in_use; });
+            t_waiting += amrex::ParallelDescriptor::second() - strt_wait;
+        }
+
+        stage.nstep = nstep;
+        stage.time  = time;
+        Snapshot(my_mfix, solve_fluid, stage);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stage.in_use = true;
+            queue.push_back(next_stage);
+        }
+        cv.notify_all();
+
+        next_stage = 1 - next_stage;
+    }
+
+    t_blocked += amrex::ParallelDescriptor::second() - strt_time;
+    n_coprocess++;
+}
+
+void
+MFIXInSitu::Snapshot (mfix& my_mfix, int solve_fluid, Stage& stage)
+{
+    BL_PROFILE("MFIXInSitu::Snapshot()");
+
+    stage.geom      = my_mfix.Geom();
+    stage.ref_ratio = my_mfix.refRatio();
+
+    if (solve_fluid)
+    {
+        std::vector<amrex::Vector<amrex::MultiFab>> views;
+        fluid_views(my_mfix, views, stage.names);
+
+        stage.fields.resize(views.size());
+        for (int i = 0; i < views.size(); ++i)
+            stage_copy(views[i], stage.fields[i]);
+    }
+
+    my_mfix.SnapshotParticles(stage.particles);
+}
+
+void
+MFIXInSitu::RunPipeline (Stage& stage, InSituPC& pc)
+{
+    amrex::Real strt_time = amrex::ParallelDescriptor::second();
+
+    std::vector<amrex::Vector<amrex::MultiFab>*> states;
+    for (auto& f : stage.fields)
+        states.push_back(&f);
+
+    adaptor->CoProcess(stage.nstep, stage.time,
+                       states, stage.names,
+                       stage.geom, stage.ref_ratio,
+                       pc,
+                       mfix::ParticleRealCompNames(),
+                       mfix::ParticleIntCompNames());
+
+    t_pipeline += amrex::ParallelDescriptor::second() - strt_time;
+}
+
+void
+MFIXInSitu::WorkerLoop ()
+{
+    while (true)
+    {
+        int i;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return shutdown || !queue.empty(); });
+            if (queue.empty())
+                return;
+            i = queue.front();
+        }
+
+        RunPipeline(stages[i], *stages[i].particles);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.pop_front();
+            stages[i].in_use = false;
+        }
+        cv.notify_all();
+    }
+}
+
+void
+MFIXInSitu::Finalize ()
+{
+    if (worker.joinable())
+    {
+        amrex::Real strt_wait = amrex::ParallelDescriptor::second();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        cv.notify_all();
+        worker.join();
+
+        const amrex::Real drain = amrex::ParallelDescriptor::second() - strt_wait;
+        t_waiting += drain;
+        t_blocked += drain;
+    }
+
+    adaptor->Finalize();
+    delete adaptor;
+    adaptor = nullptr;
+
+#ifdef BL_USE_MPI
+    MPI_Comm_free(&insitu_comm);
+#endif
+
+    // Time the pipeline ran concurrently with Evolve
+    amrex::Real t_overlap = staged ? std::max(t_pipeline - t_waiting, amrex::Real(0.0)) : 0.0;
+
+    amrex::Real timers[3] = {t_blocked, t_pipeline, t_overlap};
+    amrex::ParallelDescriptor::ReduceRealMax(timers, 3,
+                                             amrex::ParallelDescriptor::IOProcessorNumber());
+
+    if (amrex::ParallelDescriptor::IOProcessor())
+    {
+        std::cout << "In-situ co-processing calls " << n_coprocess
+                  << (staged ? " (staged)" : " (synchronous)") << std::endl;
+        std::cout << "Time blocked in in-situ     " << timers[0] << std::endl;
+        std::cout << "Time in in-situ pipeline    " << timers[1] << std::endl;
+        std::cout << "Time in-situ overlapped     " << timers[2] << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <queue>
+
+#include <AMReX_ParmParse.H>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * Cost-driven automatic load balancing                                        *
+ *                                                                             *
+ * Every auto_lb_int steps the measured per-box costs (particle_cost and       *
+ * fluid_cost) are reduced to per-rank loads. The imbalance of the current     *
+ * mapping is compared against the load a greedy knapsack re-mapping would     *
+ * achieve; the time that re-mapping would save per step is accumulated and a  *
+ * rebalance is triggered once it exceeds the measured cost of the last        *
+ * Regrid. Only the KnapSack load balance type re-maps on Regrid, so the      *
+ * automatic balancing is disabled for the other types.                        *
+ *                                                                             *
+ * Every Regrid, including the fixed regrid_int ones in main.cpp, re-maps the *
+ * grids: its time becomes the new rebalance cost and the gain accumulated     *
+ * against the old mapping is dropped (SetRebalanceCost).                      *
+ *                                                                             *
+ * With dual_grid and particle_lb_type = SFC a rebalance re-maps only the      *
+ * particle grids, along a space-filling curve weighted by the measured        *
+ * particle costs, instead of calling Regrid: Regrid would first re-map them   *
+ * with KnapSack and reset the costs. particle_lb_type only applies to the     *
+ * automatic rebalance: a regrid_int Regrid re-maps both the fluid and the     *
+ * particle grids with KnapSack and so replaces the SFC particle mapping. The  *
+ * next checks measure the costs on that mapping and switch back to SFC once   *
+ * the projected gain pays for it. Use regrid_int < 0 to keep the SFC mapping  *
+ * between automatic rebalances.                                               *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+struct LoadStats
+{
+    Real avg = 0.0;
+    Real max = 0.0;         // current mapping
+    Real max_proj = 0.0;    // projected after re-mapping
+};
+
+// Per-rank loads of the current mapping and of a greedy (LPT) knapsack mapping
+LoadStats load_stats (const MultiFab& cost)
+{
+    const BoxArray& ba = cost.boxArray();
+    const DistributionMapping& dm = cost.DistributionMap();
+    const int nprocs = ParallelDescriptor::NProcs();
+
+    Vector<Real> box_cost(ba.size(), 0.0);
+    for (MFIter mfi(cost); mfi.isValid(); ++mfi)
+        box_cost[mfi.index()] = cost[mfi].sum(mfi.validbox(), 0);
+    ParallelDescriptor::ReduceRealSum(box_cost.dataPtr(), box_cost.size());
+
+    LoadStats stats;
+
+    Vector<Real> rank_load(nprocs, 0.0);
+    for (int i = 0; i < ba.size(); ++i)
+        rank_load[dm[i]] += box_cost[i];
+
+    for (const Real l : rank_load)
+    {
+        stats.avg += l;
+        stats.max  = std::max(stats.max, l);
+    }
+    stats.avg /= nprocs;
+
+    // Longest processing time first: biggest box onto the least loaded rank
+    std::sort(box_cost.begin(), box_cost.end(), std::greater<Real>());
+    std::priority_queue<Real, std::vector<Real>, std::greater<Real>> loads;
+    for (int p = 0; p < nprocs; ++p)
+        loads.push(0.0);
+    for (const Real c : box_cost)
+    {
+        Real l = loads.top();
+        loads.pop();
+        loads.push(l + c);
+    }
+    while (!loads.empty())
+    {
+        stats.max_proj = std::max(stats.max_proj, loads.top());
+        loads.pop();
+    }
+
+    return stats;
+}
+
+// Sum of the costs of the boxes owned by this rank on every level (no
+// communication); levels without a cost array count as zero
+Vector<Real> local_costs (const Vector<std::unique_ptr<MultiFab> >& cost, int nlevs)
+{
+    Vector<Real> sums(nlevs, 0.0);
+    for (int lev = 0; lev < nlevs; ++lev)
+    {
+        if (!cost[lev])
+            continue;
+        for (MFIter mfi(*cost[lev]); mfi.isValid(); ++mfi)
+            sums[lev] += (*cost[lev])[mfi].sum(mfi.validbox(), 0);
+    }
+    return sums;
+}
+
+}
+
+void
+mfix::InitLoadBalanceParams ()
+{
+    ParmParse pp("mfix");
+
+    pp.query("auto_lb", auto_lb);
+    pp.query("auto_lb_int", auto_lb_int);
+    pp.query("auto_lb_min_gain", auto_lb_min_gain);
+    pp.query("particle_lb_type", particle_lb_type);
+    pp.query("lb_log_file", lb_log_file);
+
+    if (particle_lb_type != "KnapSack" && particle_lb_type != "SFC")
+        amrex::Abort("mfix.particle_lb_type must be KnapSack or SFC");
+
+    if (particle_lb_type == "SFC" && !dual_grid)
+    {
+        amrex::Print() << "WARNING: mfix.particle_lb_type = SFC requires dual_grid;"
+                       << " the particles follow the fluid grids" << std::endl;
+        particle_lb_type = "KnapSack";
+    }
+
+    // Regrid only re-maps the grids for the KnapSack load balance type:
+    // with any other type a "rebalance" would change nothing
+    if (auto_lb && load_balance_type != "KnapSack")
+    {
+        amrex::Print() << "WARNING: mfix.auto_lb requires mfix.load_balance_type = KnapSack;"
+                       << " automatic load balancing is disabled" << std::endl;
+        auto_lb = false;
+    }
+}
+
+bool
+mfix::AutoLoadBalanceCheck (int nstep, Real step_time)
+{
+    BL_PROFILE("mfix::AutoLoadBalanceCheck()");
+
+    if (!auto_lb || auto_lb_int <= 0 || nstep % auto_lb_int != 0 ||
+        load_balance_type != "KnapSack")
+        return false;
+
+    // All ranks must reach the same decision
+    ParallelDescriptor::ReduceRealMax(step_time);
+
+    // The step time is split between particle and fluid work in proportion to
+    // their measured costs; the part spent waiting on the busiest rank is what
+    // a better mapping can save.
+    Real gain = 0.0;
+    Real imbalance = 1.0;
+    Real imbalance_proj = 1.0;
+    Real total_max = 0.0;
+
+    // The SFC rebalance only re-maps the particle grids: the fluid work
+    // cannot be improved by it
+    const bool particles_only = sfc_particle_rebalance();
+
+    Vector<LoadStats> stats;
+    for (int lev = 0; lev <= finest_level; ++lev)
+    {
+        if (solve_dem && particle_cost[lev])
+            stats.push_back(load_stats(*particle_cost[lev]));
+        if (solve_fluid && fluid_cost[lev] && !particles_only)
+            stats.push_back(load_stats(*fluid_cost[lev]));
+    }
+
+    for (const auto& s : stats)
+        total_max += s.max;
+
+    if (total_max > 0.0)
+    {
+        Real max_proj = 0.0, avg = 0.0;
+        for (const auto& s : stats)
+        {
+            max_proj += s.max_proj;
+            avg      += s.avg;
+        }
+        imbalance      = total_max / avg;
+        imbalance_proj = max_proj  / avg;
+        gain = step_time * (total_max - max_proj) / total_max;
+    }
+
+    if (gain > auto_lb_min_gain * step_time)
+        lb_accum_gain += gain * auto_lb_int;
+
+    const bool rebalance = lb_accum_gain > lb_rebalance_cost;
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        std::ofstream log(lb_log_file, std::ios::app);
+        log << nstep << " imbalance " << imbalance
+            << " projected " << imbalance_proj
+            << " gain/step " << gain
+            << " accumulated " << lb_accum_gain
+            << " rebalance_cost " << lb_rebalance_cost
+            << " decision " << (rebalance ? "rebalance" : "keep") << "\n";
+    }
+
+    if (rebalance)
+        amrex::Print() << "Auto load balance at step " << nstep
+                       << ": imbalance " << imbalance << " -> " << imbalance_proj
+                       << ", accumulated gain " << lb_accum_gain
+                       << " > cost " << lb_rebalance_cost << std::endl;
+
+    return rebalance;
+}
+
+void
+mfix::AutoLoadBalance ()
+{
+    BL_PROFILE("mfix::AutoLoadBalance()");
+
+    Real strt_time = ParallelDescriptor::second();
+
+    if (sfc_particle_rebalance())
+    {
+        // Instead of Regrid, whose KnapSack step would re-map the particle
+        // grids (and reset their costs) before the SFC mapping is computed
+        RebalanceParticleGridsSFC();
+    }
+    else
+    {
+        Regrid();
+    }
+
+    lb_rebalance_cost = ParallelDescriptor::second() - strt_time;
+    ParallelDescriptor::ReduceRealMax(lb_rebalance_cost);
+
+    lb_accum_gain = 0.0;
+}
+
+void
+mfix::SetRebalanceCost (Real cost)
+{
+    ParallelDescriptor::ReduceRealMax(cost);
+    lb_rebalance_cost = cost;
+
+    lb_accum_gain = 0.0;
+}
+
+void
+mfix::RebalanceParticleGridsSFC ()
+{
+    BL_PROFILE("mfix::RebalanceParticleGridsSFC()");
+
+    for (int lev = 0; lev <= finest_level; ++lev)
+    {
+        const BoxArray& pba = pc->ParticleBoxArray(lev);
+
+        // Space-filling curve mapping weighted by the measured particle costs
+        DistributionMapping new_pdm = DistributionMapping::makeSFC(*particle_cost[lev]);
+
+        if (new_pdm == pc->ParticleDistributionMap(lev))
+            continue;
+
+        pc->Regrid(new_pdm, pba);
+
+        particle_ebfactory[lev].reset(
+            new EBFArrayBoxFactory(*particle_eb_levels[lev], geom[lev], pba, new_pdm,
+                                   {m_eb_basic_grow_cells, m_eb_volume_grow_cells,
+                                    m_eb_full_grow_cells}, m_eb_support_level));
+
+        particle_cost[lev].reset(new MultiFab(pba, new_pdm, 1, 0));
+        particle_cost[lev]->setVal(0.0);
+
+        RegridLevelSetArray(lev);
+    }
+}
+
+/*******************************************************************************
+ *                                                                             *
+ * Per-rank work of a step, for the step profiler                              *
+ *                                                                             *
+ * The costs are wall times measured per box inside the step, so their growth *
+ * over a step is the time this rank spent on its own boxes, without the time *
+ * it waited for other ranks in collectives. Regrid may re-allocate the cost  *
+ * arrays, so the sums are taken right before and right after Evolve.         *
+ *                                                                             *
+ ******************************************************************************/
+
+void
+mfix::StartStepWork ()
+{
+    if (!MFIXStepProfiler::Enabled())
+        return;
+
+    step_work_fluid    = local_costs(fluid_cost,    finest_level+1);
+    step_work_particle = local_costs(particle_cost, finest_level+1);
+}
+
+void
+mfix::EndStepWork ()
+{
+    if (!MFIXStepProfiler::Enabled())
+        return;
+
+    const int nlevs = finest_level + 1;
+    step_work_fluid.resize(nlevs, 0.0);
+    step_work_particle.resize(nlevs, 0.0);
+
+    const Vector<Real> fluid    = local_costs(fluid_cost,    nlevs);
+    const Vector<Real> particle = local_costs(particle_cost, nlevs);
+
+    for (int lev = 0; lev < nlevs; ++lev)
+    {
+        if (solve_fluid)
+            MFIXStepProfiler::Add(MFIXPhase::FluidWork, lev,
+                                  std::max(fluid[lev] - step_work_fluid[lev], 0.0));
+        if (solve_dem)
+            MFIXStepProfiler::Add(MFIXPhase::ParticleWork, lev,
+                                  std::max(particle[lev] - step_work_particle[lev], 0.0));
+    }
+}
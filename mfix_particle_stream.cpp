@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <unistd.h>
+
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_Utility.H>
+
+#include <mfix.H>
+
+#ifdef MFIX_USE_ZLIB
+#include <zlib.h>
+#endif
+
+/*******************************************************************************
+ *                                                                             *
+ * Binary, columnar particle stream                                            *
+ *                                                                             *
+ * Layout of the `par_bin_file` directory:                                     *
+ *                                                                             *
+ *   Header         (text) column names, types and compression flag            *
+ *   shard_NNNNN    one per rank; every call appends one record made of the    *
+ *                  selected columns, each stored contiguously and padded to   *
+ *                  8 bytes (so uncompressed columns can be mmap'ed in place)  *
+ *   Index          (binary) one entry per rank per call:                      *
+ *                     int64 nstep, double time, int64 nshards, int64 rank,    *
+ *                     int64 offset, int64 nparticles, int64 bytes[ncolumns]   *
+ *                                                                             *
+ * Columns: x, y, z, id, cpu, then the real and int components selected by     *
+ * write_real_comp / write_int_comp.                                           *
+ *                                                                             *
+ * The number of shards (ranks) is recorded per call, so a run restarted on a  *
+ * different number of ranks continues the same stream. On restart the Index  *
+ * and the shards are cut back to the records before the restart step          *
+ * (RestartParticleStream).                                                    *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+const int stream_version = 2;
+
+// Index entry: nstep, time, nshards, rank, offset, nparticles, bytes[ncolumns]
+const int entry_head = 6;
+
+std::int64_t padded (std::int64_t nbytes)
+{
+    return (nbytes + 7) / 8 * 8;
+}
+
+// Append one column to the shard, compressing it if requested; returns the
+// number of bytes stored (excluding padding).
+template <typename T>
+std::int64_t write_column (std::ofstream& ofs, const std::vector<T>& col, bool compress)
+{
+    const char* data = reinterpret_cast<const char*>(col.data());
+    std::int64_t nbytes = col.size() * sizeof(T);
+
+#ifdef MFIX_USE_ZLIB
+    std::vector<Bytef> zbuf;
+    if (compress && nbytes > 0)
+    {
+        uLongf zbytes = compressBound(nbytes);
+        zbuf.resize(zbytes);
+        if (compress2(zbuf.data(), &zbytes, reinterpret_cast<const Bytef*>(data),
+                      nbytes, Z_BEST_SPEED) != Z_OK)
+            amrex::Abort("WriteParticleStream: zlib compression failed");
+        data   = reinterpret_cast<const char*>(zbuf.data());
+        nbytes = zbytes;
+    }
+#else
+    amrex::ignore_unused(compress);
+#endif
+
+    ofs.write(data, nbytes);
+
+    static const char pad[8] = {0};
+    ofs.write(pad, padded(nbytes) - nbytes);
+
+    return nbytes;
+}
+
+}
+
+void
+mfix::WriteParticleStream (const std::string& par_bin_file, int nstep, Real time,
+                           bool compress) const
+{
+    BL_PROFILE("mfix::WriteParticleStream()");
+
+#ifndef MFIX_USE_ZLIB
+    if (compress)
+    {
+        amrex::Print() << "WARNING: par_bin_compress requires MFIX_USE_ZLIB;"
+                       << " writing uncompressed columns" << std::endl;
+        compress = false;
+    }
+#endif
+
+    const int nprocs = ParallelDescriptor::NProcs();
+    const int myproc = ParallelDescriptor::MyProc();
+    const int ioproc = ParallelDescriptor::IOProcessorNumber();
+
+    // Selected columns
+    Vector<std::string> col_names = {"x", "y", "z", "id", "cpu"};
+    Vector<std::string> col_types = {"real", "real", "real", "int", "int"};
+    Vector<int> real_comps, int_comps;
+
+    for (int i = 0; i < write_real_comp.size(); ++i)
+        if (write_real_comp[i])
+        {
+            real_comps.push_back(i);
+            col_names.push_back(ParticleRealCompNames()[i]);
+            col_types.push_back("real");
+        }
+
+    for (int i = 0; i < write_int_comp.size(); ++i)
+        if (write_int_comp[i])
+        {
+            int_comps.push_back(i);
+            col_names.push_back(ParticleIntCompNames()[i]);
+            col_types.push_back("int");
+        }
+
+    const int ncols = col_names.size();
+
+    // Header of a stream with the current configuration
+    std::stringstream header_text;
+    header_text << "MFIX-ParticleStream-V" << stream_version << "\n";
+    header_text << "real_bytes " << sizeof(Real) << "\n";
+    header_text << "int_bytes " << sizeof(int) << "\n";
+    header_text << "compression " << (compress ? "zlib" : "none") << "\n";
+    header_text << "ncolumns " << ncols << "\n";
+    for (int c = 0; c < ncols; ++c)
+        header_text << col_names[c] << " " << col_types[c] << "\n";
+
+    // First call creates the directory and the header; later calls (and
+    // restarts) append to the existing stream, which must have been written
+    // with the same columns and compression
+    const std::string header_name = par_bin_file + "/Header";
+
+    int create_stream = 0, matches = 1;
+    if (ParallelDescriptor::IOProcessor())
+    {
+        create_stream = !amrex::FileExists(header_name);
+        if (!create_stream)
+        {
+            std::ifstream hdr(header_name);
+            std::stringstream existing;
+            existing << hdr.rdbuf();
+            matches = (existing.str() == header_text.str());
+        }
+    }
+    ParallelDescriptor::Bcast(&create_stream, 1, ioproc);
+    ParallelDescriptor::Bcast(&matches, 1, ioproc);
+
+    if (!matches)
+        amrex::Abort("WriteParticleStream: " + header_name + " was written with different"
+                     " columns or compression; remove it or change"
+                     " amr.par_bin_file");
+
+    if (create_stream)
+    {
+        if (ParallelDescriptor::IOProcessor())
+        {
+            if (!amrex::UtilCreateDirectory(par_bin_file, 0755))
+                amrex::CreateDirectoryFailed(par_bin_file);
+
+            std::ofstream hdr(header_name);
+            hdr << header_text.str();
+        }
+        ParallelDescriptor::Barrier();
+    }
+
+    // Gather this rank's particles column by column
+    std::vector<Real> pos[3];
+    std::vector<int>  id, cpu;
+    std::vector< std::vector<Real> > rcol(real_comps.size());
+    std::vector< std::vector<int> >  icol(int_comps.size());
+
+    for (int lev = 0; lev <= pc->finestLevel(); ++lev)
+    {
+        for (const auto& kv : pc->GetParticles(lev))
+        {
+            const auto& aos = kv.second.GetArrayOfStructs();
+            const int np = aos.numParticles();
+
+            for (int n = 0; n < np; ++n)
+            {
+                const auto& p = aos[n];
+
+                for (int d = 0; d < 3; ++d)
+                    pos[d].push_back(p.pos(d));
+                id.push_back(p.id());
+                cpu.push_back(p.cpu());
+
+                for (int c = 0; c < real_comps.size(); ++c)
+                    rcol[c].push_back(p.rdata(real_comps[c]));
+                for (int c = 0; c < int_comps.size(); ++c)
+                    icol[c].push_back(p.idata(int_comps[c]));
+            }
+        }
+    }
+
+    // Append the record to this rank's shard
+    std::vector<std::int64_t> entry(entry_head + ncols, 0);
+    {
+        const std::string shard_name = amrex::Concatenate(par_bin_file + "/shard_", myproc, 5);
+        std::ofstream ofs(shard_name, std::ios::binary | std::ios::app);
+        if (!ofs.good())
+            amrex::FileOpenFailed(shard_name);
+
+        ofs.seekp(0, std::ios::end);
+
+        entry[0] = nstep;
+        entry[2] = nprocs;
+        entry[3] = myproc;
+        entry[4] = ofs.tellp();
+        entry[5] = id.size();
+
+        int c = entry_head;
+        for (int d = 0; d < 3; ++d)
+            entry[c++] = write_column(ofs, pos[d], compress);
+        entry[c++] = write_column(ofs, id, compress);
+        entry[c++] = write_column(ofs, cpu, compress);
+        for (const auto& col : rcol)
+            entry[c++] = write_column(ofs, col, compress);
+        for (const auto& col : icol)
+            entry[c++] = write_column(ofs, col, compress);
+    }
+
+    // Collect the per-rank entries into the index
+    std::vector<std::int64_t> all_entries(ParallelDescriptor::IOProcessor() ? nprocs*entry.size() : 0);
+    ParallelDescriptor::Gather(entry.data(), entry.size(), all_entries.data(), ioproc);
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        std::ofstream idx(par_bin_file + "/Index", std::ios::binary | std::ios::app);
+        for (int proc = 0; proc < nprocs; ++proc)
+        {
+            std::int64_t* e = &all_entries[proc*entry.size()];
+            // Time is stored as double whatever the build precision
+            const double dtime = time;
+            std::memcpy(&e[1], &dtime, sizeof(double));
+            idx.write(reinterpret_cast<const char*>(e), entry.size()*sizeof(std::int64_t));
+        }
+    }
+}
+
+void
+mfix::RestartParticleStream (const std::string& par_bin_file, int nstep) const
+{
+    BL_PROFILE("mfix::RestartParticleStream()");
+
+    if (!ParallelDescriptor::IOProcessor())
+    {
+        ParallelDescriptor::Barrier();
+        return;
+    }
+
+    const std::string header_name = par_bin_file + "/Header";
+    const std::string index_name  = par_bin_file + "/Index";
+
+    if (amrex::FileExists(header_name) && amrex::FileExists(index_name))
+    {
+        // Entry size from the column count of the header
+        int ncols = -1;
+        {
+            std::ifstream hdr(header_name);
+            std::string word;
+            while (hdr >> word)
+                if (word == "ncolumns")
+                {
+                    hdr >> ncols;
+                    break;
+                }
+        }
+
+        if (ncols < 0)
+            amrex::Abort("RestartParticleStream: no column count in " + header_name);
+
+        const int entry_len = entry_head + ncols;
+
+        // Entries of the steps before the restart, and the end of the last
+        // record they reference in every shard
+        std::vector<std::int64_t> kept;
+        std::vector<std::int64_t> shard_end;
+        int nshards = 0;
+        {
+            std::ifstream idx(index_name, std::ios::binary);
+            std::vector<std::int64_t> e(entry_len);
+            while (idx.read(reinterpret_cast<char*>(e.data()), entry_len*sizeof(std::int64_t)))
+            {
+                nshards = std::max<std::int64_t>(nshards, e[2]);
+                if (e[0] >= nstep)
+                    continue;
+
+                kept.insert(kept.end(), e.begin(), e.end());
+
+                const int rank = e[3];
+                if (shard_end.size() <= static_cast<std::size_t>(rank))
+                    shard_end.resize(rank+1, 0);
+
+                std::int64_t end = e[4];
+                for (int c = 0; c < ncols; ++c)
+                    end += padded(e[entry_head+c]);
+                shard_end[rank] = std::max(shard_end[rank], end);
+            }
+        }
+
+        std::ofstream idx(index_name, std::ios::binary | std::ios::trunc);
+        idx.write(reinterpret_cast<const char*>(kept.data()), kept.size()*sizeof(std::int64_t));
+        idx.close();
+
+        shard_end.resize(std::max<std::size_t>(shard_end.size(), nshards), 0);
+        for (int rank = 0; rank < shard_end.size(); ++rank)
+        {
+            const std::string shard_name = amrex::Concatenate(par_bin_file + "/shard_", rank, 5);
+            if (amrex::FileExists(shard_name) && ::truncate(shard_name.c_str(), shard_end[rank]) != 0)
+                amrex::Abort("RestartParticleStream: cannot truncate " + shard_name);
+        }
+
+        amrex::Print() << "Particle stream " << par_bin_file << " continued at step "
+                       << nstep << " (" << kept.size()/entry_len << " index entries kept)"
+                       << std::endl;
+    }
+
+    ParallelDescriptor::Barrier();
+}
@@ -0,0 +1,400 @@
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * Averaging-region monitors                                                   *
+ *                                                                             *
+ * Incremental replacement for WriteAverageRegions: the avg_region_* boxes are *
+ * intersected with the grids once per regrid, all regions are summed in one   *
+ * pass and one reduction per step, and the records are written in batches to *
+ * one binary file per region (<avg_file>_NNNN.bin, described by a text        *
+ * <avg_file>_NNNN.hdr). Each record is nstep, time, the instantaneous and the *
+ * running time-averaged ep_g, p_g, u_g, v_g, w_g, u_p, v_p, w_p, as doubles.  *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+bool flag_set (const Vector<int>& flags, int r)
+{
+    return r < flags.size() && flags[r] != 0;
+}
+
+std::string region_file (const std::string& base, int r, const char* ext)
+{
+    std::stringstream ss;
+    ss << base << "_" << std::setw(4) << std::setfill('0') << r << ext;
+    return ss.str();
+}
+
+// Doubles per record: nstep, time, the instantaneous and the averaged values
+constexpr int record_len = 2 + 2*MFIXRegionMonitor::nvals;
+
+}
+
+void
+mfix::SetupRegionMonitors ()
+{
+    BL_PROFILE("mfix::SetupRegionMonitors()");
+
+    const int lev = 0;
+    MFIXRegionMonitor& mon = region_mon;
+
+    const int nregions = avg_region_x_w.size();
+
+    mon.ba  = grids[lev];
+    mon.dm  = dmap[lev];
+    mon.fluid_isect.clear();
+    mon.particle_isect.clear();
+    mon.region.resize(nregions);
+
+    const Real* plo = geom[lev].ProbLo();
+    const Real* dx  = geom[lev].CellSize();
+
+    // Cell-centered index box of every region: cells whose centers lie inside
+    Vector<Box> region_box(nregions);
+    for (int r = 0; r < nregions; ++r)
+    {
+        const Real lo[3] = {avg_region_x_w[r], avg_region_y_s[r], avg_region_z_b[r]};
+        const Real hi[3] = {avg_region_x_e[r], avg_region_y_n[r], avg_region_z_t[r]};
+
+        mon.region[r] = RealBox(lo, hi);
+
+        IntVect ilo, ihi;
+        for (int d = 0; d < 3; ++d)
+        {
+            ilo[d] = static_cast<int>(std::ceil ((lo[d] - plo[d])/dx[d] - 0.5));
+            ihi[d] = static_cast<int>(std::floor((hi[d] - plo[d])/dx[d] - 0.5));
+        }
+        region_box[r] = Box(ilo, ihi);
+    }
+
+    for (MFIter mfi(*ep_g[lev], false); mfi.isValid(); ++mfi)
+    {
+        const Box& bx = mfi.validbox();
+        for (int r = 0; r < nregions; ++r)
+        {
+            const Box isect = bx & region_box[r];
+            if (isect.ok())
+                mon.fluid_isect[mfi.index()].push_back({r, isect});
+        }
+    }
+
+    if (solve_dem)
+    {
+        mon.pba = pc->ParticleBoxArray(lev);
+        mon.pdm = pc->ParticleDistributionMap(lev);
+
+        for (int i = 0; i < mon.pba.size(); ++i)
+        {
+            if (mon.pdm[i] != ParallelDescriptor::MyProc())
+                continue;
+
+            const RealBox gbox(mon.pba[i], dx, plo);
+            for (int r = 0; r < nregions; ++r)
+                if (gbox.intersects(mon.region[r]))
+                    mon.particle_isect[i].push_back(r);
+        }
+    }
+
+    if (mon.time_sum.size() != nregions*MFIXRegionMonitor::nvals)
+    {
+        mon.time_sum.assign(nregions*MFIXRegionMonitor::nvals, 0.0);
+        mon.pending.assign(nregions, Vector<Real>());
+    }
+}
+
+void
+mfix::MonitorRegions (const std::string& avg_file, int nstep, Real time, bool flush)
+{
+    BL_PROFILE("mfix::MonitorRegions()");
+
+    const int lev = 0;
+    MFIXRegionMonitor& mon = region_mon;
+
+    const int nregions = avg_region_x_w.size();
+    if (nregions == 0)
+        return;
+
+    // Intersections are recomputed only when the grids have changed
+    if (mon.ba != grids[lev] || mon.dm != dmap[lev] ||
+        (solve_dem && (mon.pba != pc->ParticleBoxArray(lev) ||
+                       mon.pdm != pc->ParticleDistributionMap(lev))) ||
+        mon.region.size() != nregions)
+        SetupRegionMonitors();
+
+    const int ns = MFIXRegionMonitor::NSums;
+    Vector<Real> sums(nregions*ns, 0.0);
+
+    // Fluid: one pass over the precomputed intersections
+    if (solve_fluid)
+    {
+        const MultiFab& volfrac = ebfactory[lev]->getVolFrac();
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        {
+            Vector<Real> priv(nregions*ns, 0.0);
+
+            for (MFIter mfi(*ep_g[lev], false); mfi.isValid(); ++mfi)
+            {
+                auto it = mon.fluid_isect.find(mfi.index());
+                if (it == mon.fluid_isect.end())
+                    continue;
+
+                Array4<Real const> const& vf  = volfrac.array(mfi);
+                Array4<Real const> const& ep  = ep_g[lev]->array(mfi);
+                Array4<Real const> const& p   = p_g[lev]->array(mfi);
+                Array4<Real const> const& vel = vel_g[lev]->array(mfi);
+
+                for (const auto& ri : it->second)
+                {
+                    const int r = ri.first;
+                    const bool do_p = flag_set(avg_p_g, r);
+                    const bool do_v = flag_set(avg_vel_g, r);
+                    Real* s = &priv[r*ns];
+
+                    const auto lo = amrex::lbound(ri.second);
+                    const auto hi = amrex::ubound(ri.second);
+
+                    for (int k = lo.z; k <= hi.z; ++k)
+                    for (int j = lo.y; j <= hi.y; ++j)
+                    for (int i = lo.x; i <= hi.x; ++i)
+                    {
+                        const Real v = vf(i,j,k);
+                        s[MFIXRegionMonitor::Vol]   += v;
+                        s[MFIXRegionMonitor::EpVol] += v*ep(i,j,k);
+
+                        if (do_p)
+                            s[MFIXRegionMonitor::PVol] += v * 0.125 *
+                                ( p(i,j  ,k  ) + p(i+1,j  ,k  ) + p(i,j+1,k  ) + p(i+1,j+1,k  )
+                                + p(i,j  ,k+1) + p(i+1,j  ,k+1) + p(i,j+1,k+1) + p(i+1,j+1,k+1) );
+
+                        if (do_v)
+                        {
+                            s[MFIXRegionMonitor::UVol] += v*vel(i,j,k,0);
+                            s[MFIXRegionMonitor::VVol] += v*vel(i,j,k,1);
+                            s[MFIXRegionMonitor::WVol] += v*vel(i,j,k,2);
+                        }
+                    }
+                }
+            }
+
+#ifdef _OPENMP
+#pragma omp critical (mfix_region_monitor)
+#endif
+            for (int n = 0; n < sums.size(); ++n)
+                sums[n] += priv[n];
+        }
+    }
+
+    // Particles: only the tiles of grids overlapping a region are visited
+    if (solve_dem)
+    {
+        for (const auto& kv : pc->GetParticles(lev))
+        {
+            auto it = mon.particle_isect.find(kv.first.first);
+            if (it == mon.particle_isect.end())
+                continue;
+
+            const auto& aos = kv.second.GetArrayOfStructs();
+            const int np = aos.numParticles();
+
+            for (const int r : it->second)
+            {
+                if (!flag_set(avg_vel_p, r))
+                    continue;
+
+                const RealBox& rb = mon.region[r];
+                Real* s = &sums[r*ns];
+
+                for (int n = 0; n < np; ++n)
+                {
+                    const auto& p = aos[n];
+                    const Real pt[3] = {p.pos(0), p.pos(1), p.pos(2)};
+                    if (rb.contains(pt))
+                    {
+                        s[MFIXRegionMonitor::NPart] += 1.0;
+                        s[MFIXRegionMonitor::UP]    += p.rdata(realData::velx);
+                        s[MFIXRegionMonitor::VP]    += p.rdata(realData::vely);
+                        s[MFIXRegionMonitor::WP]    += p.rdata(realData::velz);
+                    }
+                }
+            }
+        }
+    }
+
+    // One reduction for all regions and quantities
+    ParallelDescriptor::ReduceRealSum(sums.dataPtr(), sums.size(),
+                                      ParallelDescriptor::IOProcessorNumber());
+
+    // Each record is weighted by the time elapsed since the previous one
+    const Real dt_mon = mon.started ? time - mon.last_time : 0.0;
+
+    if (ParallelDescriptor::IOProcessor())
+    {
+        const int nv = MFIXRegionMonitor::nvals;
+
+        for (int r = 0; r < nregions; ++r)
+        {
+            const Real* s = &sums[r*ns];
+            const Real vol = s[MFIXRegionMonitor::Vol];
+            const Real npr = s[MFIXRegionMonitor::NPart];
+
+            Real inst[nv] = {
+                vol > 0.0 ? s[MFIXRegionMonitor::EpVol] / vol : 0.0,
+                vol > 0.0 ? s[MFIXRegionMonitor::PVol]  / vol : 0.0,
+                vol > 0.0 ? s[MFIXRegionMonitor::UVol]  / vol : 0.0,
+                vol > 0.0 ? s[MFIXRegionMonitor::VVol]  / vol : 0.0,
+                vol > 0.0 ? s[MFIXRegionMonitor::WVol]  / vol : 0.0,
+                npr > 0.0 ? s[MFIXRegionMonitor::UP] / npr : 0.0,
+                npr > 0.0 ? s[MFIXRegionMonitor::VP] / npr : 0.0,
+                npr > 0.0 ? s[MFIXRegionMonitor::WP] / npr : 0.0
+            };
+
+            Vector<Real>& rec = mon.pending[r];
+            rec.push_back(nstep);
+            rec.push_back(time);
+
+            for (int q = 0; q < nv; ++q)
+            {
+                mon.time_sum[r*nv+q] += dt_mon * inst[q];
+                rec.push_back(inst[q]);
+            }
+            for (int q = 0; q < nv; ++q)
+                rec.push_back(mon.time_total + dt_mon > 0.0
+                              ? mon.time_sum[r*nv+q] / (mon.time_total + dt_mon)
+                              : inst[q]);
+        }
+    }
+
+    mon.time_total += dt_mon;
+    mon.last_time   = time;
+    mon.started     = true;
+
+    if (flush)
+        FlushRegionMonitors(avg_file);
+}
+
+void
+mfix::FlushRegionMonitors (const std::string& avg_file)
+{
+    BL_PROFILE("mfix::FlushRegionMonitors()");
+
+    MFIXRegionMonitor& mon = region_mon;
+
+    if (!ParallelDescriptor::IOProcessor())
+        return;
+
+    const int nregions = mon.pending.size();
+
+    if (!mon.files_created)
+    {
+        for (int r = 0; r < nregions; ++r)
+        {
+            WriteRegionHeader(avg_file, r);
+
+            std::ofstream bin(region_file(avg_file, r, ".bin"),
+                              std::ios::binary | std::ios::trunc);
+        }
+        mon.files_created = true;
+    }
+
+    for (int r = 0; r < nregions; ++r)
+    {
+        Vector<Real>& rec = mon.pending[r];
+        if (rec.empty())
+            continue;
+
+        std::vector<double> out(rec.begin(), rec.end());
+
+        std::ofstream bin(region_file(avg_file, r, ".bin"),
+                          std::ios::binary | std::ios::app);
+        bin.write(reinterpret_cast<const char*>(out.data()), out.size()*sizeof(double));
+
+        rec.clear();
+    }
+}
+
+void
+mfix::WriteRegionHeader (const std::string& avg_file, int r) const
+{
+    const Real lo[3] = {avg_region_x_w[r], avg_region_y_s[r], avg_region_z_b[r]};
+    const Real hi[3] = {avg_region_x_e[r], avg_region_y_n[r], avg_region_z_t[r]};
+
+    std::ofstream hdr(region_file(avg_file, r, ".hdr"));
+    hdr << "MFIX-RegionMonitor-V1\n";
+    hdr << "region " << RealBox(lo, hi) << "\n";
+    hdr << "real_bytes " << sizeof(double) << "\n";
+    hdr << "columns nstep time"
+        << " ep_g p_g u_g v_g w_g u_p v_p w_p"
+        << " avg_ep_g avg_p_g avg_u_g avg_v_g avg_w_g avg_u_p avg_v_p avg_w_p\n";
+    hdr << "enabled p_g " << flag_set(avg_p_g, r)
+        << " vel_g " << flag_set(avg_vel_g, r)
+        << " vel_p " << flag_set(avg_vel_p, r) << "\n";
+}
+
+void
+mfix::RestartRegionMonitors (const std::string& avg_file, int nstep)
+{
+    BL_PROFILE("mfix::RestartRegionMonitors()");
+
+    MFIXRegionMonitor& mon = region_mon;
+
+    // The files are continued, not truncated, by the next flush
+    mon.files_created = true;
+
+    if (!ParallelDescriptor::IOProcessor())
+        return;
+
+    const int nregions = avg_region_x_w.size();
+    const int nv = MFIXRegionMonitor::nvals;
+
+    mon.time_sum.assign(nregions*nv, 0.0);
+    mon.pending.assign(nregions, Vector<Real>());
+
+    for (int r = 0; r < nregions; ++r)
+    {
+        const std::string bin_name = region_file(avg_file, r, ".bin");
+
+        // Complete records written before the restart step; a run that went
+        // past the checkpoint has written records that are about to be redone
+        std::vector<double> kept;
+        {
+            std::ifstream in(bin_name, std::ios::binary);
+            std::vector<double> rec(record_len);
+            while (in.read(reinterpret_cast<char*>(rec.data()), record_len*sizeof(double)))
+            {
+                if (rec[0] >= nstep)
+                    break;
+                kept.insert(kept.end(), rec.begin(), rec.end());
+            }
+        }
+
+        if (kept.empty())
+            WriteRegionHeader(avg_file, r);
+
+        std::ofstream bin(bin_name, std::ios::binary | std::ios::trunc);
+        bin.write(reinterpret_cast<const char*>(kept.data()), kept.size()*sizeof(double));
+
+        // Running averages of the last kept record over the records' span
+        if (!kept.empty())
+        {
+            const double* first = kept.data();
+            const double* last  = kept.data() + kept.size() - record_len;
+
+            mon.time_total = last[1] - first[1];
+            mon.last_time  = last[1];
+            mon.started    = true;
+
+            for (int q = 0; q < nv; ++q)
+                mon.time_sum[r*nv+q] = last[2+nv+q] * mon.time_total;
+        }
+    }
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <string>
+
+#include <AMReX_ParmParse.H>
+
+#include <mfix.H>
+
+/*******************************************************************************
+ *                                                                             *
+ * Replicated restart by tiling                                                *
+ *                                                                             *
+ * Instead of rebuilding grids and re-filling the level sets of a replicated   *
+ * system, the checkpointed state of the seed domain is tiled Nrep times: each *
+ * copy is a shifted view of the seed data that is ParallelCopy'd onto the     *
+ * target grids and distribution, so every rank only receives the pieces it    *
+ * owns. Afterwards only the seams (ghost cells, periodic images) and the      *
+ * walls of non-periodic boundaries are recomputed.                            *
+ *                                                                             *
+ * Tiling is only exact if the seed level sets are periodic images of each     *
+ * other across the seams: every replicated direction must be periodic, and    *
+ * the geometry must be a box (walls on the non-periodic faces only) or have   *
+ * no EB at all (CanReplicateByTiling). Anything else goes through the         *
+ * rebuilding replication of Restart.                                          *
+ *                                                                             *
+ ******************************************************************************/
+
+namespace {
+
+// Seed index-space box tiled Nrep times
+BoxArray tile_boxarray (const BoxArray& seed, const Box& seed_domain, const IntVect& Nrep)
+{
+    BoxList bl(seed.ixType());
+    const IntVect len = seed_domain.length();
+
+    for (int k = 0; k < Nrep[2]; ++k)
+    for (int j = 0; j < Nrep[1]; ++j)
+    for (int i = 0; i < Nrep[0]; ++i)
+    {
+        const IntVect shift(i*len[0], j*len[1], k*len[2]);
+        for (int n = 0; n < seed.size(); ++n)
+            bl.push_back(amrex::shift(seed[n], shift));
+    }
+
+    return BoxArray(bl);
+}
+
+// Tiling is exact: replicated directions are periodic and the EB (if any)
+// only has walls on the non-periodic faces
+bool tiling_is_exact (const Geometry& seed_geom, const IntVect& Nrep)
+{
+    for (int d = 0; d < 3; ++d)
+        if (Nrep[d] != 1 && !seed_geom.isPeriodic(d))
+            return false;
+
+    std::string geom_type;
+    ParmParse pp("mfix");
+    pp.query("geometry", geom_type);
+
+    return geom_type.empty() || geom_type == "box";
+}
+
+}
+
+bool
+mfix::CanReplicateByTiling (const IntVect& Nrep) const
+{
+    return Nrep != IntVect::TheUnitVector() && max_level == 0 &&
+           tiling_is_exact(geom[0], Nrep);
+}
+
+void
+mfix::ReplicatedRestart (const IntVect& Nrep)
+{
+    BL_PROFILE("mfix::ReplicatedRestart()");
+
+    const int lev = 0;
+    const Geometry seed_geom = geom[lev];
+
+    // Replicated domain: Nrep times the seed domain, in index and physical space
+    const Box& seed_domain = seed_geom.Domain();
+    Box domain(seed_domain);
+    domain.setBig(seed_domain.smallEnd() + seed_domain.length()*Nrep - IntVect::TheUnitVector());
+
+    const RealBox& seed_rb = seed_geom.ProbDomain();
+    Real prob_hi[3];
+    for (int d = 0; d < 3; ++d)
+        prob_hi[d] = seed_rb.lo(d) + Nrep[d] * seed_rb.length(d);
+    const RealBox rb(seed_rb.lo(), prob_hi);
+
+    int is_periodic[3];
+    for (int d = 0; d < 3; ++d)
+        is_periodic[d] = seed_geom.isPeriodic(d);
+
+    SetGeometry(lev, Geometry(domain, &rb, seed_geom.Coord(), is_periodic));
+
+    amrex::Print() << "Replicating the restart state " << Nrep << " times onto "
+                   << domain << std::endl;
+
+    // The per-face BC tables are sized by the domain: re-allocate them on the
+    // replicated domain and set the BC types again (on every level)
+    MakeBCArrays();
+    for (int l = 0; l <= max_level; ++l)
+        mfix_set_bc_type(l);
+
+    // EB of the replicated domain, then the state tiled onto it. The EB2
+    // index space cannot be assembled from shifted pieces, so all its levels
+    // (the refined level-set level too) are rebuilt. For the geometries that
+    // tile (box walls or no EB) this is a single evaluation of the implicit
+    // function; the expensive part, filling the level sets, is still tiled.
+    make_eb_geometry();
+    ReplicateState(Nrep, seed_geom);
+
+    // p0_g is the linear ramp of the pressure drop across the domain: tiled,
+    // it would jump at every seam, and gp0 would keep the seed's gradient.
+    // Both are set again from the replicated domain lengths.
+    if (solve_fluid)
+        mfix_set_p0();
+}
+
+void
+mfix::TileMultiFab (const MultiFab& src, const Box& seed_domain, const IntVect& Nrep,
+                    MultiFab& dst, const Periodicity& period)
+{
+    BL_PROFILE("mfix::TileMultiFab()");
+
+    const int ncomp = std::min(src.nComp(), dst.nComp());
+    const IntVect len = seed_domain.length();
+
+    for (int k = 0; k < Nrep[2]; ++k)
+    for (int j = 0; j < Nrep[1]; ++j)
+    for (int i = 0; i < Nrep[0]; ++i)
+    {
+        const IntVect shift(i*len[0], j*len[1], k*len[2]);
+
+        // Shifted copy of the seed data, on the seed distribution (purely
+        // local), then sent to wherever the target grids live
+        BoxArray sba = src.boxArray();
+        sba.shift(shift);
+
+        MultiFab shifted(sba, src.DistributionMap(), ncomp, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+        for (MFIter mfi(src); mfi.isValid(); ++mfi)
+        {
+            const Box& bx = mfi.validbox();
+            shifted[mfi].copy(src[mfi], bx, 0, amrex::shift(bx, shift), 0, ncomp);
+        }
+
+        dst.ParallelCopy(shifted, 0, 0, ncomp, 0, 0, period);
+    }
+
+    // Seams
+    dst.FillBoundary(period);
+}
+
+void
+mfix::ReplicateState (const IntVect& Nrep, const Geometry& seed_geom)
+{
+    BL_PROFILE("mfix::ReplicateState()");
+
+    AMREX_ALWAYS_ASSERT_WITH_MESSAGE(finest_level == 0,
+                                     "Replicated restart requires a single level");
+
+    // A non-periodic seam would carry the wall distances of the seed faces
+    // into the interior of the replicated domain
+    AMREX_ALWAYS_ASSERT_WITH_MESSAGE(tiling_is_exact(seed_geom, Nrep),
+                                     "Replicated restart by tiling requires periodic replicated "
+                                     "directions and mfix.geometry = box or no EB");
+
+    const int lev = 0;
+    const Box& seed_domain = seed_geom.Domain();
+
+    // Target grids: the seed grids tiled across the replicated domain, on a
+    // fresh distribution mapping of the target size
+    const BoxArray new_grids = tile_boxarray(grids[lev], seed_domain, Nrep);
+    const DistributionMapping new_dmap(new_grids);
+
+    SetBoxArray(lev, new_grids);
+    SetDistributionMap(lev, new_dmap);
+
+    mfix_update_ebfactory(lev);
+
+    // Fluid state, tiled directly onto the target grids
+    Vector< std::unique_ptr<MultiFab> > new_state;
+    if (solve_fluid)
+    {
+        for (auto& var : FluidStateVars())
+        {
+            const MultiFab& old_mf = *(*var.first)[lev];
+            const BoxArray ba = amrex::convert(new_grids, old_mf.ixType());
+
+            std::unique_ptr<MultiFab> tmp(new MultiFab(ba, new_dmap, old_mf.nComp(),
+                                                       old_mf.nGrow(), MFInfo(),
+                                                       *ebfactory[lev]));
+            tmp->setVal(0.0);
+            TileMultiFab(old_mf, seed_domain, Nrep, *tmp, geom[lev].periodicity());
+
+            new_state.push_back(std::move(tmp));
+        }
+    }
+
+    // Seed level sets (including the refined level-set level, if any); they
+    // are tiled in their own index space once the arrays are re-allocated
+    Vector< std::unique_ptr<MultiFab> > seed_ls(level_sets.size());
+    if (solve_dem)
+    {
+        for (int l = 0; l < level_sets.size(); ++l)
+        {
+            if (!level_sets[l])
+                continue;
+
+            const MultiFab& ls = *level_sets[l];
+            seed_ls[l].reset(new MultiFab(ls.boxArray(), ls.DistributionMap(), ls.nComp(), 0));
+            MultiFab::Copy(*seed_ls[l], ls, 0, 0, ls.nComp(), 0);
+        }
+    }
+
+    RegridArrays(lev);
+
+    if (solve_fluid)
+    {
+        int i = 0;
+        for (auto& var : FluidStateVars())
+            std::swap((*var.first)[lev], new_state[i++]);
+    }
+
+    if (solve_dem)
+    {
+        // Particles: each rank replicates the particles it holds and
+        // redistributes them onto the target grids
+        IntVect nrep = Nrep;
+        pc->Replicate(nrep, geom[lev], dmap[lev], grids[lev]);
+
+        particle_ebfactory[lev].reset(
+            new EBFArrayBoxFactory(*particle_eb_levels[lev], geom[lev], grids[lev], dmap[lev],
+                                   {m_eb_basic_grow_cells, m_eb_volume_grow_cells,
+                                    m_eb_full_grow_cells}, m_eb_support_level));
+
+        RegridLevelSetArray(lev);
+
+        for (int l = 0; l < level_sets.size(); ++l)
+        {
+            if (!seed_ls[l] || !level_sets[l])
+                continue;
+
+            // Level-set level l is refined by levelset__refinement for l > 0
+            Box ls_domain = seed_domain;
+            if (l > 0)
+                ls_domain.refine(levelset__refinement);
+
+            IntVect period_len(0,0,0);
+            for (int d = 0; d < 3; ++d)
+                if (geom[lev].isPeriodic(d))
+                    period_len[d] = ls_domain.length(d) * Nrep[d];
+
+            TileMultiFab(*seed_ls[l], ls_domain, Nrep, *level_sets[l], Periodicity(period_len));
+        }
+
+        // Walls of the non-periodic boundaries of the replicated domain
+        intersect_ls_walls();
+    }
+
+    // Keep make_eb_* from overwriting the tiled level sets
+    levelset__restart = true;
+}
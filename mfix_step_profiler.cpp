@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <string>
+
+#include <AMReX_ParmParse.H>
+
+#include <mfix_step_profiler.H>
+
+int         MFIXStepProfiler::step_prof_int    = -1;
+std::string MFIXStepProfiler::step_prof_file   = "step_profile";
+std::string MFIXStepProfiler::step_prof_format = "csv";
+
+MFIXStepProfiler::StepTimes        MFIXStepProfiler::current;
+amrex::Vector<MFIXStepProfiler::StepTimes> MFIXStepProfiler::window;
+amrex::Vector<int>                 MFIXStepProfiler::window_step;
+amrex::Vector<amrex::Real>         MFIXStepProfiler::window_time;
+
+bool MFIXStepProfiler::header_written = false;
+
+void
+MFIXStepProfiler::Initialize ()
+{
+    amrex::ParmParse pp("mfix");
+
+    pp.query("step_prof_int", step_prof_int);
+    pp.query("step_prof_file", step_prof_file);
+    pp.query("step_prof_format", step_prof_format);
+
+    if (step_prof_format != "csv" && step_prof_format != "json")
+        amrex::Abort("mfix.step_prof_format must be csv or json");
+
+    current.assign(num_phases, 0.0);
+}
+
+const char*
+MFIXStepProfiler::PhaseName (MFIXPhase phase)
+{
+    static const char* names[num_phases] = {
+        "Evolve",
+        "Regrid",
+        "Output",
+        "InSitu",
+        "FluidWork",
+        "ParticleWork"
+    };
+    return names[static_cast<int>(phase)];
+}
+
+void
+MFIXStepProfiler::Add (MFIXPhase phase, int lev, amrex::Real seconds)
+{
+    AMREX_ASSERT(lev >= -1);
+
+    const int slot = lev+1;
+    if (current.size() < (slot+1)*num_phases)
+        current.resize((slot+1)*num_phases, 0.0);
+
+    current[slot*num_phases + static_cast<int>(phase)] += seconds;
+}
+
+void
+MFIXStepProfiler::EndStep (int nstep, amrex::Real time)
+{
+    if (!Enabled())
+        return;
+
+    window.push_back(current);
+    window_step.push_back(nstep);
+    window_time.push_back(time);
+    std::fill(current.begin(), current.end(), 0.0);
+
+    if (nstep % step_prof_int == 0)
+        Flush();
+}
+
+void
+MFIXStepProfiler::Finalize ()
+{
+    if (Enabled() && !window.empty())
+        Flush();
+}
+
+std::string
+MFIXStepProfiler::FileName ()
+{
+    return step_prof_file + (step_prof_format == "csv" ? ".csv" : ".json");
+}
+
+void
+MFIXStepProfiler::Restart (int nstep)
+{
+    if (!Enabled())
+        return;
+
+    // Only the IO processor writes the file
+    if (amrex::ParallelDescriptor::IOProcessor())
+    {
+        const std::string file = FileName();
+        std::ifstream ifs(file);
+
+        if (ifs.good())
+        {
+            // Both formats have one line per record (per step for JSON) that
+            // starts with its step: "<step>,..." or {"step": <step>, ...}
+            std::string kept, line;
+            while (std::getline(ifs, line))
+            {
+                const std::size_t pos = line.find_first_of("0123456789");
+                if (line.compare(0, 4, "step") != 0 && pos != std::string::npos &&
+                    std::stol(line.substr(pos)) >= nstep)
+                    continue;
+                kept += line + "\n";
+            }
+            ifs.close();
+
+            std::ofstream ofs(file, std::ios::trunc);
+            ofs << kept;
+
+            header_written = !kept.empty();
+        }
+    }
+}
+
+void
+MFIXStepProfiler::Flush ()
+{
+    BL_PROFILE("MFIXStepProfiler::Flush()");
+
+    const int nsteps = window.size();
+    const int ioproc = amrex::ParallelDescriptor::IOProcessorNumber();
+
+    // Level slots of the deepest level timed on any rank
+    int nslots = 1;
+    for (const auto& w : window)
+        nslots = std::max(nslots, static_cast<int>(w.size()) / num_phases);
+    amrex::ParallelDescriptor::ReduceIntMax(nslots);
+
+    const int nvals = nslots*num_phases;
+
+    // All buffered steps are reduced together: one reduction per operation
+    amrex::Vector<amrex::Real> tmin(nsteps*nvals), tmax(nsteps*nvals), tsum(nsteps*nvals);
+    for (int s = 0; s < nsteps; ++s)
+        for (int i = 0; i < nvals; ++i)
+            tmin[s*nvals+i] = tmax[s*nvals+i] = tsum[s*nvals+i] =
+                (i < window[s].size()) ? window[s][i] : 0.0;
+
+    amrex::ParallelDescriptor::ReduceRealMin(tmin.dataPtr(), tmin.size(), ioproc);
+    amrex::ParallelDescriptor::ReduceRealMax(tmax.dataPtr(), tmax.size(), ioproc);
+    amrex::ParallelDescriptor::ReduceRealSum(tsum.dataPtr(), tsum.size(), ioproc);
+
+    if (amrex::ParallelDescriptor::IOProcessor())
+    {
+        const bool csv = (step_prof_format == "csv");
+        const amrex::Real nprocs = amrex::ParallelDescriptor::NProcs();
+
+        std::ofstream ofs(FileName(), header_written ? std::ios::app : std::ios::trunc);
+        ofs << std::setprecision(6);
+
+        if (csv && !header_written)
+            ofs << "step,time,level,phase,min,avg,max,imbalance\n";
+        header_written = true;
+
+        for (int s = 0; s < nsteps; ++s)
+        {
+            bool first = true;
+            if (!csv)
+                ofs << "{\"step\": " << window_step[s] << ", \"time\": " << window_time[s]
+                    << ", \"phases\": [";
+
+            for (int slot = 0; slot < nslots; ++slot)
+            {
+                for (int p = 0; p < num_phases; ++p)
+                {
+                    const int i = s*nvals + slot*num_phases + p;
+                    if (tmax[i] <= 0.0)
+                        continue;
+
+                    const amrex::Real avg = tsum[i] / nprocs;
+                    const amrex::Real imbalance = (avg > 0.0) ? tmax[i]/avg : 1.0;
+                    const char* name = PhaseName(static_cast<MFIXPhase>(p));
+
+                    if (csv)
+                    {
+                        ofs << window_step[s] << "," << window_time[s] << ","
+                            << slot-1 << "," << name << ","
+                            << tmin[i] << "," << avg << "," << tmax[i] << ","
+                            << imbalance << "\n";
+                    }
+                    else
+                    {
+                        ofs << (first ? "" : ", ")
+                            << "{\"level\": " << slot-1 << ", \"phase\": \"" << name << "\""
+                            << ", \"min\": " << tmin[i] << ", \"avg\": " << avg
+                            << ", \"max\": " << tmax[i] << ", \"imbalance\": " << imbalance
+                            << "}";
+                        first = false;
+                    }
+                }
+            }
+
+            if (!csv)
+                ofs << "]}\n";
+        }
+    }
+
+    window.clear();
+    window_step.clear();
+    window_time.clear();
+}